@@ -0,0 +1,388 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <new>
+#include <vector>
+
+#include "page_frame_allocator.hpp"
+#include "reserved_stack.hpp"
+
+#ifdef _WIN32
+#include <cstdio>
+#include <tchar.h>
+
+/*****************************************************************
+   LoggedSetLockPagesPrivilege: a function to obtain or
+   release the privilege of locking physical pages.
+
+   Inputs:
+
+       HANDLE hProcess: Handle for the process for which the
+       privilege is needed
+
+       BOOL bEnable: Enable (TRUE) or disable?
+
+   Return value: TRUE indicates success, FALSE failure.
+
+*****************************************************************/
+inline BOOL LoggedSetLockPagesPrivilege( HANDLE hProcess, BOOL bEnable ) {
+    struct {
+        DWORD Count;
+        LUID_AND_ATTRIBUTES Privilege[1];
+    } Info;
+
+    HANDLE Token;
+    BOOL Result;
+
+    // Open the token.
+
+    Result = OpenProcessToken( hProcess, TOKEN_ADJUST_PRIVILEGES, &Token );
+
+    if ( Result != TRUE ) {
+        _tprintf( _T("Cannot open process token.\n") );
+        return FALSE;
+    }
+
+    // Enable or disable?
+
+    Info.Count = 1;
+    if ( bEnable ) {
+        Info.Privilege[0].Attributes = SE_PRIVILEGE_ENABLED;
+    } else {
+        Info.Privilege[0].Attributes = 0;
+    }
+
+    // Get the LUID.
+
+    Result = LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, &( Info.Privilege[0].Luid ) );
+
+    if ( Result != TRUE ) {
+        _tprintf( _T("Cannot get privilege for %s.\n"), SE_LOCK_MEMORY_NAME );
+        return FALSE;
+    }
+
+    // Adjust the privilege.
+
+    Result = AdjustTokenPrivileges( Token, FALSE, (PTOKEN_PRIVILEGES)&Info, 0, NULL, NULL );
+
+    // Check the result.
+
+    if ( Result != TRUE ) {
+        _tprintf( _T("Cannot adjust token privileges (%u)\n"), GetLastError() );
+        return FALSE;
+    } else {
+        if ( GetLastError() != ERROR_SUCCESS ) {
+            _tprintf( _T("Cannot enable the SE_LOCK_MEMORY_NAME privilege; ") );
+            _tprintf( _T("please check the local policy.\n") );
+            return FALSE;
+        }
+    }
+
+    CloseHandle( Token );
+
+    return TRUE;
+}
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Stacks whose pages are backed by a fixed set of physical page frames. On Windows the frames are AWE pages
+// from AllocateUserPhysicalPages, on Linux they are the pages of a memfd mapped at the frame's offset. Frames
+// come from a page_frame_allocator_t, so stacks can map and unmap in any order.
+class awe_stack_pool_t {
+public:
+    typedef page_frame_allocator_t::frame_t frame_t;
+
+    // we 2 pages per coroutine to get initialized, and we need one full stack for every coroutine that
+    // may have its deep stack mapped at the same time
+    static size_t get_init_commit_size() {
+        const auto one_page_size = boost::context::stack_traits::page_size();
+        return one_page_size * 2;
+    }
+
+    awe_stack_pool_t( size_t num_stacks, size_t stack_size_in_bytes, size_t num_deep_stacks = 1 ) :
+        frames( bytes_to_pages( (num_stacks * get_init_commit_size()) + (num_deep_stacks * stack_size_in_bytes) ) ),
+        stack_size( stack_size_in_bytes ) {
+#ifdef _WIN32
+        if ( !LoggedSetLockPagesPrivilege( GetCurrentProcess(), TRUE ) ) {
+            throw std::bad_alloc();
+        }
+
+        ULONG_PTR number_of_pages = frames.num_frames();
+        page_frame_numbers.resize( number_of_pages );
+        ULONG_PTR requested_pages = number_of_pages;
+        auto result = AllocateUserPhysicalPages( GetCurrentProcess(), &number_of_pages, page_frame_numbers.data() );
+        if ( result != TRUE ) {
+            throw std::bad_alloc();
+        }
+        if ( number_of_pages != requested_pages ) {
+            page_frame_numbers.resize( number_of_pages );
+            throw std::bad_alloc();
+        }
+#else
+        const auto page_size = boost::context::stack_traits::page_size();
+        fd = ::memfd_create( "awe_frames", MFD_CLOEXEC );
+        if ( fd < 0 ) {
+            throw std::bad_alloc();
+        }
+        if ( 0 != ::ftruncate( fd, (off_t)(frames.num_frames() * page_size) ) ) {
+            ::close( fd );
+            throw std::bad_alloc();
+        }
+#endif
+    }
+    ~awe_stack_pool_t() {
+#ifdef _WIN32
+        if ( !page_frame_numbers.empty() ) {
+            ULONG_PTR number_of_pages = page_frame_numbers.size();
+            FreeUserPhysicalPages( GetCurrentProcess(), &number_of_pages, page_frame_numbers.data() );
+        }
+#else
+        ::close( fd );
+#endif
+    }
+
+    awe_stack_pool_t( const awe_stack_pool_t & ) = delete;
+    awe_stack_pool_t & operator=( const awe_stack_pool_t & ) = delete;
+
+    bool map( void * virtual_address, size_t size_in_bytes ) {
+        const size_t number_of_pages = bytes_to_pages( size_in_bytes );
+        std::vector< frame_t > mapped( number_of_pages );
+        if ( !frames.allocate( number_of_pages, mapped.data() ) ) {
+            return false;
+        }
+        if ( !map_frames( static_cast< PBYTE >(virtual_address), mapped ) ) {
+            frames.free( mapped.data(), mapped.size() );
+            return false;
+        }
+        mappings.emplace( static_cast< PBYTE >(virtual_address), std::move( mapped ) );
+        return true;
+    }
+
+    void unmap( void * virtual_address, size_t size_in_bytes ) {
+        auto it = mappings.find( static_cast< PBYTE >(virtual_address) );
+        BOOST_ASSERT_MSG( it != mappings.end(), "unmapping an address that was never mapped" );
+        BOOST_ASSERT( it->second.size() == bytes_to_pages( size_in_bytes ) );
+        release( it );
+    }
+
+    // Unmap whatever is still mapped in [begin, end).
+    void unmap_range( void * begin, void * end ) {
+        auto it = mappings.lower_bound( static_cast< PBYTE >(begin) );
+        while ( it != mappings.end() && it->first < static_cast< PBYTE >(end) ) {
+            it = release( it );
+        }
+    }
+
+#ifdef _WIN32
+    void map_stack() {
+        auto sp = GetStackPointer();
+        MEMORY_BASIC_INFORMATION stMemBasicInfo;
+        BOOST_VERIFY( VirtualQuery( sp, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+        PBYTE pCur = (PBYTE)stMemBasicInfo.BaseAddress;
+
+        PBYTE pBase = (PBYTE)stMemBasicInfo.AllocationBase;
+        if ( pBase < pCur ) {
+            BOOST_VERIFY( map( pBase, pCur - pBase ) );
+        }
+    }
+
+    void unmap_stack() {
+        auto sp = GetStackPointer();
+        MEMORY_BASIC_INFORMATION stMemBasicInfo;
+        BOOST_VERIFY( VirtualQuery( sp, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+        PBYTE pCur = (PBYTE)stMemBasicInfo.BaseAddress;
+
+        PBYTE pBase = (PBYTE)stMemBasicInfo.AllocationBase;
+        if ( pBase < pCur ) {
+            unmap( pBase, pCur - pBase );
+        }
+    }
+#else
+    // map everything between the guard page and the always mapped top pages
+    void map_stack() {
+        stack_header * hdr = find_stack_header( GetStackPointer() );
+        BOOST_ASSERT( hdr );
+        PBYTE pCur = hdr->top() - get_init_commit_size();
+        if ( hdr->usable() < pCur ) {
+            BOOST_VERIFY( map( hdr->usable(), pCur - hdr->usable() ) );
+        }
+    }
+
+    void unmap_stack() {
+        stack_header * hdr = find_stack_header( GetStackPointer() );
+        BOOST_ASSERT( hdr );
+        PBYTE pCur = hdr->top() - get_init_commit_size();
+        if ( hdr->usable() < pCur ) {
+            unmap( hdr->usable(), pCur - hdr->usable() );
+        }
+    }
+#endif
+
+    size_t get_stack_size() const { return stack_size; }
+    size_t get_free_frames() const { return frames.free_frames(); }
+
+private:
+    typedef std::map< PBYTE, std::vector< frame_t > > mapping_map;
+
+    size_t bytes_to_pages( size_t size_in_bytes ) const {
+        const auto page_size = boost::context::stack_traits::page_size();
+        // round up to page size bytes and divide
+        size_t number_of_pages = (size_in_bytes + (page_size - 1)) / page_size;
+        return number_of_pages;
+    }
+
+#ifdef _WIN32
+    bool map_frames( PBYTE virtual_address, const std::vector< frame_t > & mapped ) {
+        std::vector< ULONG_PTR > pfns( mapped.size() );
+        for ( size_t i = 0; i < mapped.size(); ++i ) {
+            pfns[i] = page_frame_numbers[mapped[i]];
+        }
+        return TRUE == MapUserPhysicalPages( virtual_address, pfns.size(), pfns.data() );
+    }
+
+    void unmap_frames( PBYTE virtual_address, size_t number_of_pages ) {
+        BOOST_VERIFY( MapUserPhysicalPages( virtual_address, number_of_pages, nullptr ) );
+    }
+#else
+    // one mmap per run of consecutive frames, a stack that gets its old frames back needs a single call
+    bool map_frames( PBYTE virtual_address, const std::vector< frame_t > & mapped ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        for ( size_t i = 0; i < mapped.size(); ) {
+            size_t j = i + 1;
+            while ( j < mapped.size() && mapped[j] == mapped[j - 1] + 1 ) {
+                ++j;
+            }
+            void * vp = ::mmap( virtual_address + i * page_size, (j - i) * page_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_FIXED, fd, (off_t)mapped[i] * page_size );
+            if ( vp == MAP_FAILED ) {
+                if ( i ) {
+                    unmap_frames( virtual_address, i );
+                }
+                return false;
+            }
+            i = j;
+        }
+        return true;
+    }
+
+    void unmap_frames( PBYTE virtual_address, size_t number_of_pages ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        BOOST_VERIFY( MAP_FAILED != ::mmap( virtual_address, number_of_pages * page_size, PROT_NONE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0 ) );
+    }
+#endif
+
+    mapping_map::iterator release( mapping_map::iterator it ) {
+        unmap_frames( it->first, it->second.size() );
+        frames.free( it->second.data(), it->second.size() );
+        return mappings.erase( it );
+    }
+
+    page_frame_allocator_t frames;
+    mapping_map mappings;
+#ifdef _WIN32
+    std::vector<ULONG_PTR> page_frame_numbers;
+#else
+    int fd;
+#endif
+    size_t stack_size;
+};
+
+class awe_fixedsize_stack {
+private:
+    awe_stack_pool_t * pool_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    awe_fixedsize_stack( awe_stack_pool_t & pool ) BOOST_NOEXCEPT_OR_NOTHROW :
+        pool_( &pool ) {
+    }
+
+#ifdef _WIN32
+    stack_context allocate() {
+        const auto one_page_size = traits_type::page_size();
+        auto size_ = pool_->get_stack_size();
+        // page at bottom will be used as guard-page
+        const std::size_t pages( static_cast< std::size_t >(std::floor( static_cast< float >(size_) / one_page_size )) );
+        BOOST_ASSERT_MSG( 1 <= pages, "at least one page must fit into stack" );
+        const std::size_t size__( pages * one_page_size );
+        BOOST_ASSERT( 0 != size_ && 0 != size__ );
+        BOOST_ASSERT( size__ <= size_ );
+
+        stack_context sctx;
+        void * vp = ::VirtualAlloc( 0, size__, MEM_RESERVE | MEM_PHYSICAL, PAGE_READWRITE );
+        if ( !vp ) goto error;
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        
+        auto init_commit_size = pool_->get_init_commit_size();
+        auto pPtr = static_cast<PBYTE>(vp) + size__;
+        pPtr -= init_commit_size;
+        if ( !pool_->map( pPtr, init_commit_size ) ) goto cleanup;
+        
+        sctx.size = size__;
+        sctx.sp = static_cast<char *>(vp) + sctx.size;
+        return sctx;
+    cleanup:
+        ::VirtualFree( vp, 0, MEM_RELEASE );
+    error:
+        throw std::bad_alloc();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+
+        void * vp = static_cast< char * >(sctx.sp) - sctx.size;
+        pool_->unmap_range( vp, sctx.sp );
+        ::VirtualFree( vp, 0, MEM_RELEASE );
+    }
+#else
+    stack_context allocate() {
+        const auto one_page_size = traits_type::page_size();
+        auto size_ = pool_->get_stack_size();
+        // page at bottom will be used as guard-page
+        const std::size_t pages( static_cast< std::size_t >(std::floor( static_cast< float >(size_) / one_page_size )) );
+        BOOST_ASSERT_MSG( 3 <= pages, "the guard and the initial commit must fit into stack" );
+        const std::size_t size__( pages * one_page_size );
+        BOOST_ASSERT( 0 != size_ && 0 != size__ );
+        BOOST_ASSERT( size__ <= size_ );
+
+        PBYTE vp = ReserveAlignedTop( size__, stack_alignment( size__ ) );
+        if ( !vp ) throw std::bad_alloc();
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        auto init_commit_size = pool_->get_init_commit_size();
+        if ( !pool_->map( vp + size__ - init_commit_size, init_commit_size ) ) {
+            ::munmap( vp, size__ );
+            throw std::bad_alloc();
+        }
+
+        stack_header * hdr = InitStackHeader( vp, size__, one_page_size );
+
+        stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        PBYTE base = hdr->base;
+        std::size_t size = hdr->size;
+        pool_->unmap_range( base, base + size );
+        ::munmap( base, size );
+    }
+#endif
+};
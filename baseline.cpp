@@ -6,6 +6,7 @@
 #include <tchar.h>
 #include <windows.h>
 #include <Psapi.h>
+#include "bench.hpp"
 
 
 DWORD GetPageSize() {
@@ -36,20 +37,6 @@ void StackConsume( DWORD dwSizeExtra ) {
     StackConsume( pPtr, dwSizeExtra );
 }
 
-class timer_t {
-private:
-    std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
-public:
-    timer_t() {
-        start_time = std::chrono::high_resolution_clock::now();
-    }
-
-    double stop() {
-        auto stop_time = std::chrono::high_resolution_clock::now();
-        return std::chrono::duration<double>( stop_time - start_time ).count();
-    }
-};
-
 int main() {
     int count = 1'000'000;
     using think_fn = void(*)();
@@ -62,11 +49,12 @@ int main() {
         } );
     }
 
-    timer_t timer;
+    timer time;
+    time.start();
     for ( auto & think : thinks ) {
         think();
     }
-    double elapsed = timer.stop();
+    double elapsed = time.stop();
     std::cout << "Thought for " << elapsed << " seconds." << std::endl;
     
     return 0;
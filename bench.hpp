@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <Psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+class timer {
+private:
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
+public:
+    void start() {
+        start_time = std::chrono::high_resolution_clock::now();
+    }
+
+    double stop() {
+        auto stop_time = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double>( stop_time - start_time ).count();
+    }
+};
+
+struct process_usage {
+    std::size_t     resident_bytes = 0;
+    std::size_t     peak_resident_bytes = 0;    // since the last ResetPeakResident
+    std::uint64_t   minor_faults = 0;           // page faults served without I/O, over the life of the process
+};
+
+// Start the peak resident set over from the current one. Linux only, on Windows the peak covers the whole
+// life of the process.
+inline void ResetPeakResident() {
+#ifndef _WIN32
+    std::ofstream clear_refs( "/proc/self/clear_refs" );
+    clear_refs << "5";
+#endif
+}
+
+inline process_usage QueryProcessUsage() {
+    process_usage usage;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    counters.cb = sizeof( counters );
+    if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) ) {
+        usage.resident_bytes = counters.WorkingSetSize;
+        usage.peak_resident_bytes = counters.PeakWorkingSetSize;
+        usage.minor_faults = counters.PageFaultCount;
+    }
+#else
+    const std::size_t page_size = (std::size_t)::sysconf( _SC_PAGESIZE );
+    {
+        std::ifstream statm( "/proc/self/statm" );
+        std::size_t size = 0, resident = 0;
+        statm >> size >> resident;
+        usage.resident_bytes = resident * page_size;
+    }
+    // VmHWM follows clear_refs, ru_maxrss does not
+    std::ifstream status( "/proc/self/status" );
+    for ( std::string line; std::getline( status, line ); ) {
+        if ( 0 == line.compare( 0, 6, "VmHWM:" ) ) {
+            usage.peak_resident_bytes = std::stoull( line.substr( 6 ) ) * 1024;
+            break;
+        }
+    }
+    rusage ru = {};
+    if ( 0 == ::getrusage( RUSAGE_SELF, &ru ) ) {
+        usage.minor_faults = (std::uint64_t)ru.ru_minflt;
+        if ( !usage.peak_resident_bytes ) {
+            usage.peak_resident_bytes = (std::size_t)ru.ru_maxrss * 1024;
+        }
+    }
+#endif
+    return usage;
+}
+
+// Resident pages that were given back with MADV_FREE and not reclaimed yet, they still count towards the
+// resident set until the kernel needs them. Always 0 on Windows, MEM_RESET pages leave the working set with
+// the next trim.
+inline std::size_t QueryLazyFreeBytes() {
+    std::size_t bytes = 0;
+#ifndef _WIN32
+    std::ifstream rollup( "/proc/self/smaps_rollup" );
+    for ( std::string line; std::getline( rollup, line ); ) {
+        if ( 0 == line.compare( 0, 9, "LazyFree:" ) ) {
+            bytes = std::stoull( line.substr( 9 ) ) * 1024;
+            break;
+        }
+    }
+#endif
+    return bytes;
+}
+
+inline std::size_t ProcessResidentBytes() {
+    return QueryProcessUsage().resident_bytes;
+}
@@ -0,0 +1,80 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "deep_stack.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+struct bench_result {
+    double parked_bytes;    // resident bytes per parked coroutine
+    double think_ns;        // per resume of the 900K think
+};
+
+void Report( const char * which, std::size_t stack_size, const bench_result & r ) {
+    std::cout << std::left << std::setw( 10 ) << which << std::right << std::fixed
+              << " stack: " << std::setw( 5 ) << stack_size / 1024 << "KiB"
+              << " parked: " << std::setprecision( 0 ) << std::setw( 8 ) << r.parked_bytes << " bytes"
+              << " think: " << std::setprecision( 1 ) << std::setw( 10 ) << r.think_ns << " ns" << std::endl;
+}
+
+// Every coroutine thinks depth deep on every resume and suspends. With deep set the think runs on the thread's
+// deep stack and the coroutine's own stack never grows, otherwise it runs in place and gets shrunk after.
+bench_result RunThinks( int count, int resumes, std::size_t stack_size, DWORD depth, bool deep ) {
+    bench_result r;
+    reserved_fixedsize_stack stack{ stack_size };
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( count );
+    std::size_t rss = ProcessResidentBytes();
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [depth, deep]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                if ( deep ) {
+                    call_on_shared_stack( [depth] { StackConsume( depth ); } );
+                } else {
+                    StackConsume( depth );
+                    StackShrink();
+                }
+                c();
+            }
+        } );
+    }
+    timer time;
+    time.start();
+    for ( int n = 0; n < resumes; ++n ) {
+        for ( auto & think : thinks ) {
+            think();
+        }
+    }
+    r.think_ns = time.stop() * 1e9 / ((double)count * resumes);
+    r.parked_bytes = ((double)ProcessResidentBytes() - rss) / count;
+    return r;
+}
+
+int main( int argc, char ** argv ) {
+    // every think, on a 1 MiB or a 32 KiB stack alike, has a reservation of its own with a guard mapping
+    // below the stack, so the 65530 mappings of the default vm.max_map_count end a run at about 32000
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 4;
+    DWORD depth = argc > 3 ? (DWORD)std::atoi( argv[3] ) * 1024 : 900 * 1024;
+
+    // committed before anything is measured, it is there once per thread
+    ThreadDeepStack();
+
+    Report( "reserved", 1024 * 1024, RunThinks( count, resumes, 1024 * 1024, depth, false ) );
+    Report( "deep call", 32 * 1024, RunThinks( count, resumes, 32 * 1024, depth, true ) );
+
+    timer time;
+    time.start();
+    const int calls = 10'000'000;
+    for ( int i = 0; i < calls; ++i ) {
+        call_on_shared_stack( [] {} );
+    }
+    std::cout << "switch to the deep stack and back: " << std::setprecision( 1 ) << time.stop() * 1e9 / calls
+              << " ns" << std::endl;
+    return 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/context/detail/fcontext.hpp>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "reserved_stack.hpp"
+
+// A stack for the deep calls of a thread's coroutines that never suspend. A coroutine switches to it for the
+// duration of one call and back again, so its own stack only has to hold what it keeps across suspends and can
+// be reserved at tens of KiB instead of the depth of its deepest call. The stack is committed once when it is
+// created and never shrunk, every call finds its pages resident. Only one call can run on it at a time and fn
+// must not suspend the coroutine, so use one per thread (ThreadDeepStack).
+class deep_stack_t {
+public:
+    deep_stack_t( std::size_t stack_size, stack_huge_pages huge_pages = stack_huge_pages::never ) :
+        alloc_( stack_size, huge_pages ), sctx_( alloc_.allocate() ) {
+        call( [] { StackCommit(); } );
+    }
+
+    ~deep_stack_t() {
+        alloc_.deallocate( sctx_ );
+    }
+
+    deep_stack_t( const deep_stack_t & ) = delete;
+    deep_stack_t & operator=( const deep_stack_t & ) = delete;
+
+    // Run fn on this stack and return what it returns, exceptions included. A call from fn itself runs in
+    // place, it is on this stack already.
+    template< typename Fn >
+    std::invoke_result_t< Fn & > call( Fn && fn ) {
+        using result_type = std::invoke_result_t< Fn & >;
+        static_assert( !std::is_reference_v< result_type >, "return a pointer, the result is moved out of the call" );
+        if ( running_ ) {
+            return fn();
+        }
+        if constexpr ( std::is_void_v< result_type > ) {
+            auto body = [&fn] { fn(); };
+            run( []( void * p ) { (*static_cast< decltype(body) * >(p))(); }, &body );
+        } else {
+            std::optional< result_type > result;
+            auto body = [&fn, &result] { result.emplace( fn() ); };
+            run( []( void * p ) { (*static_cast< decltype(body) * >(p))(); }, &body );
+            return std::move( *result );
+        }
+    }
+
+    bool running() const { return running_; }
+    std::size_t size() const { return sctx_.size; }
+
+private:
+    struct call_frame {
+        void                ( *body )( void * );
+        void *              arg;
+        std::exception_ptr  except;
+    };
+
+    // a fresh context for every call, nothing of the last one is left on the stack once it switched back
+    void run( void ( *body )( void * ), void * arg ) {
+        namespace ctx = boost::context::detail;
+        call_frame frame{ body, arg, nullptr };
+        running_ = true;
+        ctx::jump_fcontext( ctx::make_fcontext( sctx_.sp, sctx_.size, &entry ), &frame );
+        running_ = false;
+        if ( frame.except ) {
+            std::rethrow_exception( frame.except );
+        }
+    }
+
+    static void entry( boost::context::detail::transfer_t t ) {
+        auto frame = static_cast< call_frame * >(t.data);
+        try {
+            frame->body( frame->arg );
+        } catch ( ... ) {
+            frame->except = std::current_exception();
+        }
+        boost::context::detail::jump_fcontext( t.fctx, nullptr );
+        BOOST_ASSERT_MSG( false, "finished deep call resumed" );
+    }
+
+    reserved_fixedsize_stack        alloc_;
+    boost::context::stack_context   sctx_;
+    bool                            running_ = false;
+};
+
+// Size of the deep stack every thread gets for call_on_shared_stack, read when a thread makes its first call.
+inline std::size_t deep_stack_size = 1 * 1024 * 1024;
+
+// The calling thread's deep stack, created and committed by its first use.
+inline deep_stack_t & ThreadDeepStack() {
+    thread_local deep_stack_t stack( deep_stack_size );
+    return stack;
+}
+
+// Run fn on the calling thread's deep stack and switch back, for the part of a coroutine that goes deep but
+// never suspends.
+template< typename Fn >
+std::invoke_result_t< Fn & > call_on_shared_stack( Fn && fn ) {
+    return ThreadDeepStack().call( std::forward< Fn >( fn ) );
+}
@@ -0,0 +1,135 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_arena.hpp"
+#include "soft_dirty_shrink.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+int failures = 0;
+
+// depth frames deep, then suspend without StackPark and check every frame once resumed. A pass that went by
+// the park point of the suspend before would have released them.
+STACK_NOINLINE void Hold( int depth, std::uint32_t seed, think_co::pull_type & c ) {
+    volatile std::uint32_t costs[64];
+    for ( int i = 0; i < 64; ++i ) costs[i] = seed + i;
+    if ( depth == 0 ) {
+        c();
+    } else {
+        Hold( depth - 1, seed * 31 + 7, c );
+    }
+    for ( int i = 0; i < 64; ++i ) failures += costs[i] != seed + i;
+}
+
+// count thinks park after consuming 900K without shrinking themselves. Every tick resumes the next active of
+// them and then runs one shrink pass over the whole population, either releasing everything below every
+// parked stack or only what the soft-dirty tracking says changed. Warm-up ticks run until everybody has
+// parked once and are not measured.
+//
+// With unparked every think is resumed twice a tick: the first resume parks it, the second has it shrink its
+// own stack and suspend again below that park point without parking, which no pass may touch.
+void RunTicks( bool incremental, bool unparked, int count, int ticks, int active, size_t stack_size ) {
+    stack_arena_t arena{ (size_t)count, stack_size };
+    arena_fixedsize_stack stack{ arena };
+    std::vector<think_co::push_type> thinks;
+    std::vector<stack_header*> own( count );
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [&, i, unparked]( think_co::pull_type& c ) {
+            own[i] = find_stack_header( GetStackPointer() );
+            for ( ;; ) {
+                StackConsume( 900 * 1024 );
+                StackPark();
+                c();
+                if ( unparked ) {
+                    // it shrinks its own stack this time, the passes are not to touch it
+                    StackShrink();
+                    Hold( 128, i, c );
+                }
+            }
+        } );
+    }
+    // the passes rely on every resume going through StackBeginResume, a fresh stack has not parked yet
+    auto resume = [&]( int i ) {
+        if ( own[i] ) {
+            StackBeginResume( own[i] );
+        }
+        thinks[i]();
+        StackEndResume( own[i] );
+    };
+
+    std::vector<stack_header*> hdrs;
+    hdrs.reserve( count );
+    arena.for_each_stack( [&]( stack_header & hdr ) { hdrs.push_back( &hdr ); } );
+
+    soft_dirty_shrinker_t shrinker;
+    active = std::max( 1, std::min( active, count ) );
+    const int warmup = (count + active - 1) / active;
+    int next = 0;
+    double total_pass = 0;
+    soft_dirty_stats total;
+    for ( int tick = 0; tick < warmup + ticks; ++tick ) {
+        for ( int i = 0; i < active; ++i ) {
+            resume( next );
+            if ( unparked ) {
+                resume( next );
+            }
+            next = (next + 1) % count;
+        }
+
+        timer time;
+        time.start();
+        soft_dirty_stats s = incremental ? shrinker.shrink( hdrs.data(), hdrs.size() )
+                                         : soft_dirty_shrinker_t::shrink_all( hdrs.data(), hdrs.size() );
+        double pass = time.stop();
+        if ( tick >= warmup ) {
+            total_pass += pass;
+            total.skipped += s.skipped;
+            total.madvise_calls += s.madvise_calls;
+            total.pagemap_reads += s.pagemap_reads;
+            total.released_pages += s.released_pages;
+        }
+    }
+
+    const int measured = std::max( 1, ticks );
+    const std::string name = std::string( unparked ? "unparked " : "" )
+                           + (incremental ? (shrinker.soft_dirty() ? "soft-dirty" : "present") : "full");
+    std::cout << std::left << std::setw( 20 ) << name << std::right << std::fixed << std::setprecision( 3 )
+              << " pass: " << std::setw( 8 ) << total_pass * 1e3 / measured << " ms"
+              << std::setprecision( 0 )
+              << ", skipped: " << std::setw( 8 ) << (double)total.skipped / measured
+              << ", madvise: " << std::setw( 8 ) << (double)total.madvise_calls / measured
+              << ", pagemap reads: " << std::setw( 6 ) << (double)total.pagemap_reads / measured
+              << ", released pages: " << std::setw( 8 ) << (double)total.released_pages / measured
+              << ", rss: " << std::setprecision( 1 ) << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB";
+    if ( unparked ) {
+        std::cout << ", corrupted frames: " << failures;
+    }
+    std::cout << std::endl;
+
+    arena.begin_teardown();
+    thinks.clear();
+}
+
+int main( int argc, char ** argv ) {
+    // one mapping for the whole arena, but two per stack on kernels before 6.13 without guard markers
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int ticks = argc > 2 ? std::atoi( argv[2] ) : 10;
+    int active = argc > 3 ? std::atoi( argv[3] ) : 1000;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    RunTicks( false, false, count, ticks, active, stack_size );
+    RunTicks( true, false, count, ticks, active, stack_size );
+    RunTicks( false, true, count, ticks, active, stack_size );
+    RunTicks( true, true, count, ticks, active, stack_size );
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdint>
+#include <sys/resource.h>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "file_stack.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+int node_pool[1024];
+int failures = 0;
+
+// Plan depth frames deep and sleep at the bottom, checking every frame again after the resume to catch a
+// stack that did not come back from the file intact.
+STACK_NOINLINE std::uint32_t Plan( int depth, std::uint32_t seed, think_co::pull_type & c ) {
+    volatile std::uint32_t costs[48];
+    int * volatile nodes[8];
+    for ( int i = 0; i < 48; ++i ) costs[i] = (seed + i) % 97;
+    for ( int i = 0; i < 8; ++i ) nodes[i] = &node_pool[(seed * 8 + i) % 1024];
+
+    std::uint32_t sum = 0;
+    if ( depth == 0 ) {
+        StackPark();
+        c();
+    } else {
+        sum = Plan( depth - 1, seed * 31 + 7, c );
+    }
+
+    for ( int i = 0; i < 48; ++i ) failures += costs[i] != (seed + i) % 97;
+    for ( int i = 0; i < 8; ++i ) failures += nodes[i] != &node_pool[(seed * 8 + i) % 1024];
+    return sum + costs[seed % 48];
+}
+
+long MajorFaults() {
+    rusage usage;
+    ::getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_majflt;
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 10'000;
+    int depth = argc > 2 ? std::atoi( argv[2] ) : 64;
+    const char * dir = argc > 3 ? argv[3] : "/var/tmp";
+    size_t stack_size = 1 * 1024 * 1024;
+
+    file_stack_space_t space{ dir, stack_size };
+    std::vector<file_backed_coroutine> thinks;
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( space,
+        [depth, i]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                Plan( depth, i, c );
+            }
+        } );
+    }
+
+    for ( auto & think : thinks ) {
+        think();
+    }
+    std::cout << "asleep:    rss " << std::fixed << std::setprecision( 1 )
+              << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB, file "
+              << (double)space.stats().file_bytes / (1024 * 1024) << "MiB" << std::endl;
+
+    timer time;
+    time.start();
+    for ( auto & think : thinks ) {
+        think.page_out();
+    }
+    double elapsed = time.stop();
+    auto stats = space.stats();
+    std::cout << "paged out: rss " << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB, file "
+              << (double)stats.file_bytes / (1024 * 1024) << "MiB, "
+              << (double)stats.written_bytes / (1024 * 1024) << "MiB written, " << std::setprecision( 3 )
+              << elapsed << " seconds" << std::endl;
+
+    long faults = MajorFaults();
+    time.start();
+    for ( auto & think : thinks ) {
+        think();
+    }
+    elapsed = time.stop();
+    std::cout << "resumed:   " << elapsed << " seconds, " << MajorFaults() - faults << " major faults, rss "
+              << std::setprecision( 1 ) << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB, "
+              << failures << " corrupted frames" << std::endl;
+    return 0;
+}
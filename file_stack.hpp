@@ -0,0 +1,304 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <boost/coroutine2/all.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "reserved_stack.hpp"
+
+struct file_stack_stats {
+    std::uint64_t page_outs = 0;        // page_out calls that had a parked stack to write out
+    std::uint64_t written_bytes = 0;    // live stack written back and dropped, resident or not
+    std::uint64_t punched_bytes = 0;    // dead stack punched out of the file by them
+    std::uint64_t file_bytes = 0;       // disk blocks the file holds right now
+};
+
+// Stacks mapped MAP_SHARED from one unlinked file in dir instead of anonymous memory, every stack a slot of
+// the file. Their pages are page cache pages, which the kernel can write back to the file and drop under
+// memory pressure on hosts without swap, and page_out() does so explicitly for a coroutine that is parked
+// for long (file_backed_coroutine): it writes the live part of the stack back with msync and reclaims it
+// with MADV_PAGEOUT, the next resume reads it back in through the faults. Releasing pages from such a stack punches them out of the file
+// (ReleaseStackPages), so dead stack never costs disk space or write back.
+//
+// dir has to be on a disk backed file system that can punch holes, ext4, xfs or btrfs; on tmpfs the pages
+// would go to swap like anonymous ones. Stacks that run get written back by the flusher threads every now
+// and then like any dirty file page, which is I/O an anonymous stack never causes.
+class file_stack_space_t {
+public:
+    file_stack_space_t( const char * dir, std::size_t stack_size ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(stack_size) / page_size )) );
+        BOOST_ASSERT_MSG( 3 <= pages, "the guard and the initial commit must fit into stack" );
+        size_ = pages * page_size;
+        align_ = stack_alignment( size_ );
+
+        fd_ = ::open( dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600 );
+        if ( fd_ < 0 && (errno == EOPNOTSUPP || errno == EISDIR) ) {
+            // no O_TMPFILE on this file system, unlink it right away instead
+            std::string path = std::string( dir ) + "/stack.XXXXXX";
+            fd_ = ::mkostemp( &path[0], O_CLOEXEC );
+            if ( fd_ >= 0 ) {
+                ::unlink( path.c_str() );
+            }
+        }
+        if ( fd_ < 0 ) {
+            throw std::system_error( errno, std::system_category(), dir );
+        }
+    }
+
+    ~file_stack_space_t() {
+        ::close( fd_ );
+    }
+
+    file_stack_space_t( const file_stack_space_t & ) = delete;
+    file_stack_space_t & operator=( const file_stack_space_t & ) = delete;
+
+    boost::context::stack_context allocate() {
+        const auto one_page_size = boost::context::stack_traits::page_size();
+
+        PBYTE vp = ReserveAlignedTop( size_, align_ );
+        if ( !vp ) throw std::bad_alloc();
+
+        // the guard page stays an anonymous PROT_NONE reservation, the file only backs the usable part
+        const off_t offset = take_slot();
+        if ( offset < 0 || MAP_FAILED == ::mmap( vp + one_page_size, size_ - one_page_size, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_FIXED, fd_, offset ) ) {
+            ::munmap( vp, size_ );
+            if ( offset >= 0 ) {
+                give_slot( offset );
+            }
+            throw std::bad_alloc();
+        }
+
+        // a growing stack touches its pages one at a time, readahead around a fault would only fill the page
+        // cache with holes, in large folios that MADV_PAGEOUT can not take apart again
+        BOOST_VERIFY( 0 == ::madvise( vp + one_page_size, size_ - one_page_size, MADV_RANDOM ) );
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        const auto init_commit_size = one_page_size + one_page_size;
+        CommitPages( vp + size_ - init_commit_size, init_commit_size );
+
+        stack_header * hdr = InitStackHeader( vp, size_, one_page_size );
+        hdr->file_backed = true;
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            // a fresh stack is resumed for the first time with no parks
+            offsets_.emplace( hdr, slot{ offset, 0 } );
+        }
+
+        boost::context::stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( boost::context::stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        BOOST_ASSERT( hdr->self == hdr );
+        off_t offset;
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            auto it = offsets_.find( hdr );
+            BOOST_ASSERT( it != offsets_.end() );
+            offset = it->second.offset;
+            offsets_.erase( it );
+        }
+        // give the blocks back before the slot goes to the next stack, which expects it to read as zeroes
+        PBYTE base = hdr->base;
+        BOOST_VERIFY( 0 == ::madvise( hdr->usable(), size_ - hdr->guard_size, MADV_REMOVE ) );
+        ::munmap( base, size_ );
+        give_slot( offset );
+    }
+
+    // Call right before every resume but the first of a coroutine on one of these stacks, file_backed_coroutine
+    // does. Records the stack's park count next to its slot for page_out.
+    void begin_resume( stack_header * hdr ) {
+        const std::uint32_t parks = hdr->parks.load( std::memory_order_relaxed );
+        std::lock_guard< std::mutex > lock( mutex_ );
+        offsets_.at( hdr ).resume_parks = parks;
+    }
+
+    // Write the stack of a parked coroutine out to the file and drop it from memory. Everything below the
+    // page under the one it parked in is dead (see StackPark) and punched out for good, the rest is written
+    // back and reclaimed, header page included. Only while the coroutine is suspended. Unless it called
+    // StackPark since it was last resumed (begin_resume), its frames may lie below the old park point and
+    // nothing is done. Returns the live bytes written.
+    std::size_t page_out( stack_header * hdr ) {
+        BOOST_ASSERT( hdr->file_backed );
+        PBYTE sp = hdr->parked_sp.load( std::memory_order_acquire );
+        const slot s = slot_of( hdr );
+        if ( !sp || hdr->parks.load( std::memory_order_acquire ) == s.resume_parks ) {
+            return 0;
+        }
+        const auto page_size = boost::context::stack_traits::page_size();
+        // nothing may read the header once it is written out, it would only come straight back in
+        PBYTE pUsable = hdr->usable();
+        PBYTE pLive = (std::max)( pUsable, sp - ((uintptr_t)sp & (page_size - 1)) - page_size );
+        PBYTE pTop = hdr->top();
+        const off_t offset = s.offset;
+        if ( pUsable < pLive ) {
+            BOOST_VERIFY( 0 == ::madvise( pUsable, pLive - pUsable, MADV_REMOVE ) );
+        }
+
+        // reclaim only drops clean file pages, a dirty one would have to wait for the flusher threads
+        BOOST_VERIFY( 0 == ::msync( pLive, pTop - pLive, MS_SYNC ) );
+        if ( 0 != ::madvise( pLive, pTop - pLive, MADV_PAGEOUT ) ) {
+            // kernels before 5.4, unmap the pages and drop them from the page cache, they are clean now
+            BOOST_VERIFY( 0 == ::madvise( pLive, pTop - pLive, MADV_DONTNEED ) );
+            ::posix_fadvise( fd_, offset + (pLive - pUsable), pTop - pLive, POSIX_FADV_DONTNEED );
+        }
+
+        std::lock_guard< std::mutex > lock( mutex_ );
+        ++stats_.page_outs;
+        stats_.written_bytes += pTop - pLive;
+        stats_.punched_bytes += pLive - pUsable;
+        return pTop - pLive;
+    }
+
+    file_stack_stats stats() const {
+        file_stack_stats s;
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            s = stats_;
+        }
+        struct stat st;
+        if ( 0 == ::fstat( fd_, &st ) ) {
+            s.file_bytes = (std::uint64_t)st.st_blocks * 512;
+        }
+        return s;
+    }
+
+    std::size_t get_stack_size() const { return size_; }
+
+private:
+    // file offset of the next free slot, growing the file by one slot if there is none
+    off_t take_slot() {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        if ( !free_.empty() ) {
+            off_t offset = free_.back();
+            free_.pop_back();
+            return offset;
+        }
+        const off_t slot_size = size_ - boost::context::stack_traits::page_size();
+        const off_t offset = slots_ * slot_size;
+        // sparse, blocks are only allocated for pages the stacks write
+        if ( 0 != ::ftruncate( fd_, offset + slot_size ) ) {
+            return -1;
+        }
+        ++slots_;
+        return offset;
+    }
+
+    void give_slot( off_t offset ) {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        free_.push_back( offset );
+    }
+
+    struct slot {
+        off_t           offset;
+        std::uint32_t   resume_parks;   // hdr->parks when the coroutine was last resumed
+    };
+
+    slot slot_of( stack_header * hdr ) const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return offsets_.at( hdr );
+    }
+
+    std::size_t                                     size_;
+    std::size_t                                     align_;
+    int                                             fd_ = -1;
+
+    mutable std::mutex                              mutex_;
+    off_t                                           slots_ = 0;
+    std::vector< off_t >                            free_;
+    std::unordered_map< stack_header *, slot >      offsets_;
+    file_stack_stats                                stats_;
+};
+
+// StackAllocator handle onto a file_stack_space_t.
+class file_fixedsize_stack {
+private:
+    file_stack_space_t * space_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    file_fixedsize_stack( file_stack_space_t & space ) BOOST_NOEXCEPT_OR_NOTHROW :
+        space_( &space ) {
+    }
+
+    stack_context allocate() {
+        return space_->allocate();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        space_->deallocate( sctx );
+    }
+};
+
+// A push coroutine on a file_stack_space_t stack that can be paged out while it is suspended. Every resume goes
+// through begin_resume, so page_out only ever writes out a coroutine that called StackPark right before it
+// suspended and leaves one that did not alone. The header of its stack is picked up on the first resume.
+class file_backed_coroutine {
+public:
+    typedef boost::coroutines2::coroutine< void > co_type;
+
+    template< typename Fn >
+    file_backed_coroutine( file_stack_space_t & space, Fn && fn ) :
+        state_( new state{ &space, nullptr } ),
+        co_( file_fixedsize_stack{ space },
+             [s = state_.get(), fn = std::forward< Fn >( fn )]( co_type::pull_type & c ) mutable {
+                 s->hdr = find_stack_header( GetStackPointer() );
+                 fn( c );
+             } ) {
+    }
+
+    file_backed_coroutine( file_backed_coroutine && ) = default;
+    file_backed_coroutine & operator=( file_backed_coroutine && ) = default;
+
+    void operator()() {
+        if ( state_->hdr ) {
+            state_->space->begin_resume( state_->hdr );
+        }
+        co_();
+    }
+
+    // Write the stack out to the file until the next resume faults it back in. Only while suspended.
+    std::size_t page_out() {
+        return state_->hdr && co_ ? state_->space->page_out( state_->hdr ) : 0;
+    }
+
+    explicit operator bool() const BOOST_NOEXCEPT_OR_NOTHROW { return static_cast< bool >( co_ ); }
+
+private:
+    struct state {
+        file_stack_space_t *    space;
+        stack_header *          hdr;
+    };
+
+    // declared first so the coroutine, and with it any unwinding, goes before the state it captured
+    std::unique_ptr< state >    state_;
+    co_type::push_type          co_;
+};
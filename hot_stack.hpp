@@ -0,0 +1,89 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <cstddef>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "reserved_stack.hpp"
+
+// A single memfd that holds the deep part of a stack. The running coroutine maps it over the part of its
+// own reservation below the current stack pointer on resume, and unmaps it again before it suspends. The
+// file pages stay in the page cache in between, so every coroutine that maps them finds them already
+// resident and warm, and the kernel never has to zero them again. Only one coroutine may have it mapped at
+// a time, so use one per thread.
+//
+// huge_pages must be the policy of the allocator the stacks come from, hugetlb excepted: unmapping puts the
+// range back as that allocator left it, so it merges into the stack's mapping again instead of leaving a
+// VMA behind on every think.
+class hot_stack_region_t {
+public:
+    hot_stack_region_t( std::size_t stack_size, bool populate = true,
+                        stack_huge_pages huge_pages = stack_huge_pages::never ) :
+        populate_( populate ), huge_pages_( huge_pages ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        size_ = stack_size & ~(page_size - 1);
+        fd_ = ::memfd_create( "hot_stack", MFD_CLOEXEC );
+        if ( fd_ < 0 ) throw std::bad_alloc();
+        if ( 0 != ::ftruncate( fd_, size_ ) ) {
+            ::close( fd_ );
+            throw std::bad_alloc();
+        }
+    }
+
+    ~hot_stack_region_t() {
+        ::close( fd_ );
+    }
+
+    hot_stack_region_t( const hot_stack_region_t & ) = delete;
+    hot_stack_region_t & operator=( const hot_stack_region_t & ) = delete;
+
+    // Map the hot pages over everything between the guard region and the page below the caller's frame.
+    void map_stack() {
+        PBYTE sp = GetStackPointer();
+        BOOST_ASSERT_MSG( !mapped_begin_, "hot region is already mapped" );
+        const auto page_size = boost::context::stack_traits::page_size();
+
+        stack_header * hdr = find_stack_header( sp );
+        BOOST_ASSERT( hdr );
+        BOOST_ASSERT_MSG( !hdr->hugetlb, "a hugetlb stack can not be put back once the hot region is unmapped" );
+        PBYTE pBegin = hdr->usable();
+        PBYTE pEnd = sp - ((uintptr_t)sp & (page_size - 1)) - page_size;
+        if ( pEnd <= pBegin ) {
+            return;
+        }
+        BOOST_ASSERT( (std::size_t)(pEnd - pBegin) <= size_ );
+
+        // file offset 0 always backs the deepest page so a given depth lands on the same physical page
+        // in every coroutine
+        const int flags = MAP_SHARED | MAP_FIXED | (populate_ ? MAP_POPULATE : 0);
+        BOOST_VERIFY( MAP_FAILED != ::mmap( pBegin, pEnd - pBegin, PROT_READ | PROT_WRITE, flags, fd_, 0 ) );
+        mapped_begin_ = pBegin;
+        mapped_end_ = pEnd;
+    }
+
+    // Put the address range back to the empty read/write stack pages it replaced, nothing live may be left
+    // below the caller's frame.
+    void unmap_stack() {
+        if ( !mapped_begin_ ) {
+            return;
+        }
+        BOOST_ASSERT_MSG( GetStackPointer() > mapped_end_, "stack frames left in the hot region" );
+        BOOST_VERIFY( MAP_FAILED != ::mmap( mapped_begin_, mapped_end_ - mapped_begin_, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0 ) );
+        AdviseHugePages( mapped_begin_, mapped_end_ - mapped_begin_, huge_pages_ );
+        mapped_begin_ = nullptr;
+        mapped_end_ = nullptr;
+    }
+
+    std::size_t get_size() const { return size_; }
+
+private:
+    int                 fd_;
+    std::size_t         size_;
+    bool                populate_;
+    stack_huge_pages    huge_pages_;
+    PBYTE               mapped_begin_ = nullptr;
+    PBYTE               mapped_end_ = nullptr;
+};
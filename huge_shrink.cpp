@@ -0,0 +1,135 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+// MemAvailable of the system. A huge page StackShrink splits leaves the resident set right away, but its memory
+// only goes back once the kernel gets round to splitting it for good, which it does under memory pressure.
+std::size_t SystemAvailableBytes() {
+    std::ifstream meminfo( "/proc/meminfo" );
+    for ( std::string line; std::getline( meminfo, line ); ) {
+        if ( 0 == line.compare( 0, 13, "MemAvailable:" ) ) {
+            return std::stoull( line.substr( 13 ) ) * 1024;
+        }
+    }
+    return 0;
+}
+
+// AnonHugePages of the process, the transparent huge pages it has resident. hugetlb pages are not in there.
+std::size_t AnonHugeBytes() {
+    std::ifstream rollup( "/proc/self/smaps_rollup" );
+    for ( std::string line; std::getline( rollup, line ); ) {
+        if ( 0 == line.compare( 0, 14, "AnonHugePages:" ) ) {
+            return std::stoull( line.substr( 14 ) ) * 1024;
+        }
+    }
+    return 0;
+}
+
+// count coroutines think depth deep, shrink and suspend. Transparent huge pages are what THP set to always does
+// to every stack with a whole huge page in it: the first touch faults in 2 MiB, and the shrink only splits it.
+void RunParked( const char * name, stack_huge_pages huge_pages, int count, std::size_t stack_size, DWORD depth ) {
+    reserved_fixedsize_stack stack{ stack_size, huge_pages };
+    const std::size_t available_before = SystemAvailableBytes();
+    ResetPeakResident();
+    const std::size_t rss_before = ProcessResidentBytes();
+    {
+        std::vector<think_co::push_type> thinks;
+        thinks.reserve( count );
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( stack,
+            [depth]( think_co::pull_type& c ) {
+                for ( ;; ) {
+                    StackConsume( depth );
+                    StackShrink();
+                    c();
+                }
+            } );
+        }
+        for ( auto & think : thinks ) {
+            think();
+        }
+        auto usage = QueryProcessUsage();
+        std::cout << name << std::fixed << std::setprecision( 1 )
+                  << (double)(usage.peak_resident_bytes - rss_before) / (1024 * 1024) << "MiB peak rss, "
+                  << (double)((std::ptrdiff_t)usage.resident_bytes - (std::ptrdiff_t)rss_before) / (1024 * 1024)
+                  << "MiB rss parked, "
+                  << (double)((std::ptrdiff_t)available_before - (std::ptrdiff_t)SystemAvailableBytes()) / (1024 * 1024)
+                  << "MiB taken from the system"
+                  << std::endl;
+    }
+}
+
+// depth frames of a MiB each, then accesses random cache lines of all of them: a long lived deep stack
+// working on what its callers keep, where every access is a dTLB miss with small pages.
+STACK_NOINLINE std::uint64_t Walk( int depth, std::vector<volatile BYTE *> & frames, int accesses ) {
+    volatile BYTE frame[1024 * 1024];
+    for ( std::size_t i = 0; i < sizeof( frame ); i += 4096 ) {
+        frame[i] = (BYTE)i;
+    }
+    frames.push_back( frame );
+    if ( depth > 1 ) {
+        return Walk( depth - 1, frames, accesses );
+    }
+
+    std::uint64_t sum = 0;
+    std::uint32_t x = 2463534242u;
+    for ( int i = 0; i < accesses; ++i ) {
+        x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+        volatile BYTE * f = frames[x % frames.size()];
+        sum += f[(x >> 8) % sizeof( frame ) & ~63u]++;
+    }
+    return sum;
+}
+
+void RunDeep( const char * name, stack_huge_pages huge_pages, int depth, int accesses ) {
+    reserved_fixedsize_stack stack{ (std::size_t)(depth + 8) * 1024 * 1024, huge_pages };
+    bool hugetlb = false;
+    double elapsed = 0;
+    std::size_t huge_bytes = 0;
+    think_co::push_type deep( stack,
+    [&]( think_co::pull_type& ) {
+        hugetlb = find_stack_header( GetStackPointer() )->hugetlb;
+        std::vector<volatile BYTE *> frames;
+        frames.reserve( depth );
+        // a first walk faults the stack in, the second one is timed
+        Walk( depth, frames, accesses );
+        frames.clear();
+        timer time;
+        time.start();
+        Walk( depth, frames, accesses );
+        elapsed = time.stop();
+        huge_bytes = AnonHugeBytes();
+    } );
+    deep();
+    std::cout << name << std::fixed << std::setprecision( 2 ) << elapsed * 1e9 / accesses << "ns per access, "
+              << (hugetlb ? "hugetlb pages" : std::to_string( huge_bytes / (1024 * 1024) ) + "MiB transparent huge pages")
+              << (huge_pages == stack_huge_pages::hugetlb && !hugetlb ? " (hugetlb pool empty)" : "") << std::endl;
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 200;
+    DWORD depth = argc > 2 ? (DWORD)std::atoi( argv[2] ) * 1024 : 16 * 1024;
+    int frames = argc > 3 ? std::atoi( argv[3] ) : 48;
+    int accesses = argc > 4 ? std::atoi( argv[4] ) : 20'000'000;
+    const std::size_t stack_size = 4 * 1024 * 1024;
+
+    std::cout << count << " parked coroutines on 4 MiB stacks, " << depth / 1024 << "KiB deep" << std::endl;
+    RunParked( "  never:       ", stack_huge_pages::never, count, stack_size, depth );
+    RunParked( "  transparent: ", stack_huge_pages::transparent, count, stack_size, depth );
+
+    std::cout << "random access to " << frames << "MiB of deep stack" << std::endl;
+    RunDeep( "  never:       ", stack_huge_pages::never, frames, accesses );
+    RunDeep( "  transparent: ", stack_huge_pages::transparent, frames, accesses );
+    RunDeep( "  hugetlb:     ", stack_huge_pages::hugetlb, frames, accesses );
+    return 0;
+}
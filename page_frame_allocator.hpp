@@ -0,0 +1,48 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hands out indices of physical page frames from a LIFO free-list, in batches, and takes them back in any
+// order. Frames freed together are pushed so that they come back out in the same order, which keeps a
+// stack that is unmapped and mapped again on the same, contiguous frames. Not thread safe.
+class page_frame_allocator_t {
+public:
+    typedef std::uint32_t frame_t;
+
+    explicit page_frame_allocator_t( std::size_t num_frames ) : num_frames_( num_frames ) {
+        free_.reserve( num_frames );
+        // lowest frame on top so a fresh allocator hands out 0, 1, 2, ...
+        for ( std::size_t i = num_frames; i-- > 0; ) {
+            free_.push_back( static_cast< frame_t >(i) );
+        }
+    }
+
+    // Take count frames, all or nothing.
+    bool allocate( std::size_t count, frame_t * frames ) {
+        if ( count > free_.size() ) {
+            return false;
+        }
+        for ( std::size_t i = 0; i < count; ++i ) {
+            frames[i] = free_[free_.size() - 1 - i];
+        }
+        free_.resize( free_.size() - count );
+        return true;
+    }
+
+    void free( const frame_t * frames, std::size_t count ) {
+        BOOST_ASSERT( free_.size() + count <= num_frames_ );
+        for ( std::size_t i = count; i-- > 0; ) {
+            free_.push_back( frames[i] );
+        }
+    }
+
+    std::size_t free_frames() const { return free_.size(); }
+    std::size_t num_frames() const { return num_frames_; }
+
+private:
+    std::vector< frame_t >  free_;
+    std::size_t             num_frames_;
+};
@@ -0,0 +1,82 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdint>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_parking.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+int node_pool[1024];
+int failures = 0;
+
+// Plan depth frames deep and sleep at the bottom. Every frame keeps what a search would: small costs and
+// pointers into shared data, checked again after the resume to catch a stack that did not come back intact.
+STACK_NOINLINE std::uint32_t Plan( int depth, std::uint32_t seed, think_co::pull_type & c ) {
+    volatile std::uint32_t costs[48];
+    int * volatile nodes[8];
+    for ( int i = 0; i < 48; ++i ) costs[i] = (seed + i) % 97;
+    for ( int i = 0; i < 8; ++i ) nodes[i] = &node_pool[(seed * 8 + i) % 1024];
+
+    std::uint32_t sum = 0;
+    if ( depth == 0 ) {
+        StackPark();
+        c();
+    } else {
+        sum = Plan( depth - 1, seed * 31 + 7, c );
+    }
+
+    for ( int i = 0; i < 48; ++i ) failures += costs[i] != (seed + i) % 97;
+    for ( int i = 0; i < 8; ++i ) failures += nodes[i] != &node_pool[(seed * 8 + i) % 1024];
+    return sum + costs[seed % 48];
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 10'000;
+    int depth = argc > 2 ? std::atoi( argv[2] ) : 64;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    reserved_fixedsize_stack stack{ stack_size };
+    stack_parking_t parking;
+    std::vector<parkable_coroutine> thinks;
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( parking, stack,
+        [depth, i]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                Plan( depth, i, c );
+            }
+        } );
+    }
+
+    for ( auto & think : thinks ) {
+        think();
+    }
+    std::cout << "asleep:   rss " << std::fixed << std::setprecision( 1 )
+              << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB" << std::endl;
+
+    timer time;
+    time.start();
+    for ( auto & think : thinks ) {
+        think.park();
+    }
+    double elapsed = time.stop();
+    auto stats = parking.stats();
+    std::cout << "parked:   rss " << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB, "
+              << (double)stats.parked_bytes / (1024 * 1024) << "MiB compressed, ratio " << std::setprecision( 2 )
+              << stats.ratio() << ", " << std::setprecision( 3 ) << elapsed << " seconds" << std::endl;
+
+    time.start();
+    for ( auto & think : thinks ) {
+        think();
+    }
+    elapsed = time.stop();
+    stats = parking.stats();
+    std::cout << "restored: " << elapsed << " seconds, " << std::setprecision( 1 ) << stats.mean_restore_s() * 1e6
+              << "us mean, " << stats.max_restore_s * 1e6 << "us worst per coroutine, "
+              << failures << " corrupted frames" << std::endl;
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "pooled_stack.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+// Spawn count thinks, run each once depth deep and tear them all down again, generations times over, so every
+// generation pays for creating and destroying its stacks. Nothing shrinks the stacks: a fresh reservation
+// faults its depth in again on every generation, a pooled stack comes back with it still committed.
+template< typename StackAllocator >
+double RunGenerations( StackAllocator stack, int count, int generations, DWORD depth ) {
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( count );
+
+    timer time;
+    time.start();
+    for ( int gen = 0; gen < generations; ++gen ) {
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( stack,
+            [depth]( think_co::pull_type& c ) {
+                StackConsume( depth );
+            } );
+        }
+        for ( auto & think : thinks ) {
+            think();
+        }
+        thinks.clear();
+    }
+    return time.stop();
+}
+
+int main( int argc, char ** argv ) {
+    // the reserved run has count reservations live at once, two mappings each, and the pool keeps as many;
+    // 20000 stays clear of vm.max_map_count and keeps the pooled 64 KiB deep stacks at about 1.3 GiB
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int generations = argc > 2 ? std::atoi( argv[2] ) : 4;
+    DWORD depth = argc > 3 ? (DWORD)std::atoi( argv[3] ) * 1024 : 64 * 1024;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    double elapsed = RunGenerations( reserved_fixedsize_stack{ stack_size }, count, generations, depth );
+    std::cout << "reserved: Thought for " << elapsed << " seconds." << std::endl;
+
+    stack_pool_t pool{ stack_size };
+    elapsed = RunGenerations( pooled_fixedsize_stack{ pool }, count, generations, depth );
+    std::cout << "pooled:   Thought for " << elapsed << " seconds." << std::endl;
+
+    auto stats = pool.stats();
+    std::cout << "pool: hit rate " << std::fixed << std::setprecision( 3 ) << stats.hit_rate()
+              << " (" << stats.hits << "/" << stats.allocations << ")"
+              << ", size " << stats.pool_size
+              << ", committed " << std::setprecision( 2 ) << (double)stats.committed_bytes / (1024 * 1024) << "MiB"
+              << ", trimmed " << stats.trimmed << std::endl;
+
+    pool.trim( stack_pool_t::clock_type::now() + std::chrono::hours( 1 ) );
+    std::cout << "pool after full decay: size " << pool.stats().pool_size << std::endl;
+
+    return 0;
+}
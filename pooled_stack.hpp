@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "reserved_stack.hpp"
+#include "stack_region.hpp"
+
+struct stack_pool_stats {
+    std::uint64_t allocations = 0;
+    std::uint64_t hits = 0;             // served from the free-list
+    std::uint64_t misses = 0;           // needed a fresh reservation
+    std::uint64_t trimmed = 0;          // reservations released by decay or the size cap
+    std::size_t   pool_size = 0;        // stacks sitting on the free-list
+    std::size_t   committed_bytes = 0;  // resident bytes of the stacks on the free-list, measured by stats()
+
+    double hit_rate() const { return allocations ? (double)hits / allocations : 0.0; }
+};
+
+// Keeps released stacks on a LIFO free-list with whatever they still have committed, so the stack that was
+// released last, and is the most likely to still be resident and in cache, goes to the next coroutine.
+// Entries that sit in the pool longer than the decay are released by trim(). Not thread safe, use one pool
+// per thread.
+class stack_pool_t {
+public:
+    typedef boost::context::stack_context stack_context;
+    typedef std::chrono::steady_clock clock_type;
+
+    stack_pool_t( std::size_t stack_size, clock_type::duration decay = std::chrono::seconds( 1 ),
+                  std::size_t max_pooled = SIZE_MAX, std::size_t max_pooled_commit = SIZE_MAX ) :
+        alloc_( stack_size ), decay_( decay ), max_pooled_( max_pooled ), max_pooled_commit_( max_pooled_commit ) {
+    }
+
+    ~stack_pool_t() {
+        clear();
+    }
+
+    stack_pool_t( const stack_pool_t & ) = delete;
+    stack_pool_t & operator=( const stack_pool_t & ) = delete;
+
+    stack_context allocate() {
+        ++stats_.allocations;
+        if ( free_.empty() ) {
+            ++stats_.misses;
+            return alloc_.allocate();
+        }
+        ++stats_.hits;
+        entry e = free_.back();
+        free_.pop_back();
+#ifndef _WIN32
+        ResetStackHeader( static_cast< stack_header * >(e.sctx.sp) );
+#endif
+        return e.sctx;
+    }
+
+    void deallocate( stack_context & sctx ) {
+        if ( free_.size() >= max_pooled_ ) {
+            ++stats_.trimmed;
+            alloc_.deallocate( sctx );
+            return;
+        }
+        if ( max_pooled_commit_ != SIZE_MAX ) {
+            StackTrim( sctx, max_pooled_commit_ );
+        }
+        free_.push_back( entry{ sctx, clock_type::now() } );
+    }
+
+    // Release every pooled stack that has been idle for longer than the decay. The front of the free-list
+    // holds the oldest entries so this stops at the first one that is still young enough.
+    void trim( clock_type::time_point now = clock_type::now() ) {
+        while ( !free_.empty() && now - free_.front().released > decay_ ) {
+            release_oldest();
+        }
+    }
+
+    // Release every pooled stack however young, when memory is short.
+    void clear() {
+        while ( !free_.empty() ) {
+            release_oldest();
+        }
+    }
+
+    // Walks the resident pages of every pooled stack for committed_bytes, keep it off hot paths.
+    stack_pool_stats stats() const {
+        stack_pool_stats s = stats_;
+        s.pool_size = free_.size();
+        for ( const entry & e : free_ ) {
+            s.committed_bytes += committed_bytes( e.sctx );
+        }
+        return s;
+    }
+
+private:
+    struct entry {
+        stack_context           sctx;
+        clock_type::time_point  released;
+    };
+
+    static std::size_t committed_bytes( const stack_context & sctx ) {
+        stack_region_info regions[max_stack_regions];
+        const std::size_t count = (std::min)( QueryStackRegions( static_cast< PBYTE >(sctx.sp) - 1, regions, max_stack_regions ),
+                                              max_stack_regions );
+        std::size_t pages = 0;
+        for ( std::size_t i = 0; i < count; ++i ) {
+            pages += regions[i].resident_pages;
+        }
+        return pages * RegionPageSize();
+    }
+
+    void release_oldest() {
+        ++stats_.trimmed;
+        alloc_.deallocate( free_.front().sctx );
+        free_.pop_front();
+    }
+
+    reserved_fixedsize_stack    alloc_;
+    std::deque< entry >         free_;
+    clock_type::duration        decay_;
+    std::size_t                 max_pooled_;
+    std::size_t                 max_pooled_commit_;
+    stack_pool_stats            stats_;
+};
+
+// StackAllocator handle onto a stack_pool_t, cheap to copy into every coroutine.
+class pooled_fixedsize_stack {
+private:
+    stack_pool_t * pool_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    pooled_fixedsize_stack( stack_pool_t & pool ) BOOST_NOEXCEPT_OR_NOTHROW :
+        pool_( &pool ) {
+    }
+
+    stack_context allocate() {
+        return pool_->allocate();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        pool_->deallocate( sctx );
+    }
+};
@@ -0,0 +1,75 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+enum class commit_mode {
+    fault,      // the kernel faults every page back in
+    commit,     // StackCommit, the whole reservation
+    inside,     // StackPrefault() first thing in every resume
+    outside,    // StackPrefault( hdr ) by whoever resumes it
+};
+
+// Every resume consumes depth and shrinks again before it suspends, like the thinks in co_shrink. The pages
+// faulted in count the ones MADV_POPULATE_WRITE brought in too, the kernel accounts them the same way; what
+// the prefault saves is a trap per page.
+void RunTicks( const char * name, commit_mode mode, int count, int ticks, DWORD depth ) {
+    reserved_fixedsize_stack stack{ 1 * 1024 * 1024 };
+    std::vector<think_co::push_type> thinks;
+    std::vector<stack_header *> stacks( count );
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [mode, depth, i, &stacks]( think_co::pull_type& c ) {
+            stacks[i] = find_stack_header( GetStackPointer() );
+            for ( ;; ) {
+                if ( mode == commit_mode::commit ) {
+                    StackCommit();
+                } else if ( mode == commit_mode::inside ) {
+                    StackPrefault();
+                }
+                StackConsume( depth );
+                StackShrink();
+                c();
+            }
+        } );
+    }
+
+    // the first round runs them all once, from then on the depth of the last run is known
+    for ( auto & think : thinks ) {
+        think();
+    }
+    auto before = QueryProcessUsage();
+    timer time;
+    time.start();
+    for ( int t = 0; t < ticks; ++t ) {
+        for ( int i = 0; i < count; ++i ) {
+            if ( mode == commit_mode::outside ) {
+                StackPrefault( stacks[i] );
+            }
+            thinks[i]();
+        }
+    }
+    double elapsed = time.stop();
+    const double resumes = (double)count * ticks;
+    std::cout << name << std::fixed << std::setprecision( 2 ) << elapsed * 1e6 / resumes << "us, "
+              << std::setprecision( 1 ) << (QueryProcessUsage().minor_faults - before.minor_faults) / resumes
+              << " pages faulted in per resume" << std::endl;
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 1000;
+    int ticks = argc > 2 ? std::atoi( argv[2] ) : 20;
+    DWORD depth = argc > 3 ? (DWORD)std::atoi( argv[3] ) * 1024 : 900 * 1024;
+
+    RunTicks( "page faults:       ", commit_mode::fault, count, ticks, depth );
+    RunTicks( "StackCommit:       ", commit_mode::commit, count, ticks, depth );
+    RunTicks( "prefault, inside:  ", commit_mode::inside, count, ticks, depth );
+    RunTicks( "prefault, outside: ", commit_mode::outside, count, ticks, depth );
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "pooled_stack.hpp"
+#include "stack_metrics.hpp"
+#include "stack_pressure.hpp"
+#include "stack_reclaimer.hpp"
+
+// count thinks consume depth, park and suspend without shrinking: nothing gives their pages back but the
+// pressure monitor. A pool keeps pool_size more stacks cached, each with depth committed.
+struct workload {
+    stack_reclaimer_t                   reclaimer{ std::chrono::milliseconds( 200 ), stack_reclaimer_t::clock_type::duration::max() };
+    std::mutex                          pool_mutex;
+    stack_pool_t                        pool{ 1 * 1024 * 1024, std::chrono::hours( 1 ) };
+    std::vector<reclaimable_coroutine>  thinks;
+
+    workload( int count, int pool_size, DWORD depth ) {
+        reclaimed_stack< reserved_fixedsize_stack > stack{ reclaimer, reserved_fixedsize_stack{ 1 * 1024 * 1024 } };
+        thinks.reserve( count );
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( stack,
+            [depth]( boost::coroutines2::coroutine< void >::pull_type& c ) {
+                for ( ;; ) {
+                    StackConsume( depth );
+                    StackPark();
+                    c();
+                }
+            } );
+        }
+        std::lock_guard< std::mutex > lock( pool_mutex );
+        std::vector<boost::coroutines2::coroutine< void >::push_type> pooled;
+        for ( int i = 0; i < pool_size; ++i ) {
+            pooled.emplace_back( pooled_fixedsize_stack{ pool }, [depth]( boost::coroutines2::coroutine< void >::pull_type& ) {
+                StackConsume( depth );
+            } );
+        }
+        for ( auto & co : pooled ) {
+            co();
+        }
+    }
+
+    void resume() {
+        for ( auto & think : thinks ) {
+            think();
+        }
+    }
+
+    void hook( pressure_step step ) {
+        if ( step == pressure_step::drain ) {
+            std::lock_guard< std::mutex > lock( pool_mutex );
+            pool.clear();
+        }
+    }
+};
+
+void Report( const char * what, workload & w, const stack_pressure_monitor_t & monitor ) {
+    auto stats = monitor.stats();
+    std::size_t pooled;
+    {
+        std::lock_guard< std::mutex > lock( w.pool_mutex );
+        pooled = w.pool.stats().pool_size;
+    }
+    std::cout << std::left << std::setw( 22 ) << what << std::right << std::fixed << std::setprecision( 1 )
+              << " rss " << std::setw( 6 ) << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB, lazy free "
+              << std::setw( 6 ) << (double)QueryLazyFreeBytes() / (1024 * 1024) << "MiB, " << pooled << " pooled, passes "
+              << stats.passes[(int)pressure_step::lazy] << '/' << stats.passes[(int)pressure_step::parked] << '/'
+              << stats.passes[(int)pressure_step::drain] << " lazy/parked/drain" << std::endl;
+}
+
+// The monitor against a fake source, the escalation goes the same on any box.
+void RunFake( int count, int pool_size, DWORD depth ) {
+    workload w( count, pool_size, depth );
+    manual_pressure_source source;
+    stack_pressure_monitor_t monitor( source, w.reclaimer, std::chrono::milliseconds( 500 ), std::chrono::seconds( 2 ) );
+    monitor.add_hook( [&w]( pressure_step step ) { w.hook( step ); } );
+
+    w.resume();
+    Report( "running", w, monitor );
+    std::this_thread::sleep_for( std::chrono::seconds( 1 ) );
+    Report( "calm for 1s", w, monitor );
+
+    source.set( memory_pressure::some );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+    Report( "some pressure", w, monitor );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+    Report( "  0.75s later", w, monitor );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+    Report( "  1.25s later", w, monitor );
+    source.set( memory_pressure::none );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 2500 ) );
+
+    w.resume();
+    Report( "resumed all", w, monitor );
+    source.set( memory_pressure::full );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+    Report( "full pressure", w, monitor );
+    source.set( memory_pressure::none );
+}
+
+// The monitor against a real source for seconds, reporting once a second.
+void RunReal( memory_pressure_source & source, int count, int pool_size, DWORD depth, int seconds ) {
+    workload w( count, pool_size, depth );
+    stack_pressure_monitor_t monitor( source, w.reclaimer );
+    monitor.add_hook( [&w]( pressure_step step ) { w.hook( step ); } );
+    w.resume();
+    for ( int s = 0; s <= seconds; ++s ) {
+        Report( ("after " + std::to_string( s ) + "s").c_str(), w, monitor );
+        std::this_thread::sleep_for( std::chrono::seconds( 1 ) );
+    }
+}
+
+int main( int argc, char ** argv ) {
+    const char * mode = argc > 1 ? argv[1] : "fake";
+    int count = argc > 2 ? std::atoi( argv[2] ) : 1000;
+    int pool_size = argc > 3 ? std::atoi( argv[3] ) : 200;
+    DWORD depth = argc > 4 ? (DWORD)std::atoi( argv[4] ) * 1024 : 256 * 1024;
+    int seconds = argc > 5 ? std::atoi( argv[5] ) : 10;
+
+    try {
+        if ( 0 == std::strcmp( mode, "psi" ) ) {
+            psi_pressure_source source;
+            RunReal( source, count, pool_size, depth, seconds );
+        } else if ( 0 == std::strcmp( mode, "cgroup" ) ) {
+            cgroup_pressure_source source;
+            RunReal( source, count, pool_size, depth, seconds );
+        } else if ( 0 == std::strcmp( mode, "rss" ) ) {
+            // pressure from half of what the workload takes up, so it does go off
+            const std::size_t soft = (std::size_t)count * depth / 2;
+            rss_pressure_source source( soft, 2 * soft );
+            stack_metrics_t metrics;
+            memory_sampler_t sampler( metrics, std::chrono::milliseconds( 100 ),
+                                      [&source]( const memory_sample & s ) { source.sample( s ); } );
+            RunReal( source, count, pool_size, depth, seconds );
+        } else {
+            RunFake( count, pool_size, depth );
+        }
+    } catch ( const std::exception & e ) {
+        std::cerr << mode << ": " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_profile.hpp"
+
+// Recurse until about bytes of stack are in use. Unlike StackConsume this leaves real frames behind, return
+// addresses and non-zero locals, which is what the profiler looks for.
+STACK_NOINLINE int UseStack( int bytes ) {
+    volatile int frame[256];
+    frame[0] = bytes;
+    if ( bytes > (int)sizeof( frame ) ) {
+        return UseStack( bytes - (int)sizeof( frame ) ) + frame[0];
+    }
+    return frame[0];
+}
+
+// Two kinds of thinks: most of them stay shallow, the few pathfinders sometimes go deep. Every think runs for
+// a number of resumes and finishes, which is when the profiler takes its final look at the stack.
+double Run( stack_profiler_t & profiler, int count, int resumes ) {
+    using think_co = boost::coroutines2::coroutine< void >;
+    size_t stack_size = 1 * 1024 * 1024;
+    profiled_stack< reserved_fixedsize_stack > think_stack{ profiler, "Think", reserved_fixedsize_stack{ stack_size } };
+    profiled_stack< reserved_fixedsize_stack > path_stack{ profiler, "Pathfind", reserved_fixedsize_stack{ stack_size } };
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( count );
+
+    for ( int i = 0; i < count; ++i ) {
+        const bool pathfinder = i % 16 == 0;
+        auto body = [=]( think_co::pull_type& c ) {
+            std::minstd_rand rng( i + 1 );
+            for ( int n = 0; n < resumes; ++n ) {
+                int depth = pathfinder ? 64 * 1024 + (int)(rng() % (640 * 1024)) : 8 * 1024 + (int)(rng() % (24 * 1024));
+                UseStack( depth );
+                StackShrink();
+                c();
+            }
+        };
+        if ( pathfinder ) {
+            thinks.emplace_back( path_stack, body );
+        } else {
+            thinks.emplace_back( think_stack, body );
+        }
+    }
+
+    timer time;
+    time.start();
+    for ( int n = 0; n <= resumes; ++n ) {
+        for ( auto & think : thinks ) {
+            if ( think ) think();
+        }
+    }
+    thinks.clear();
+    return time.stop();
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 10'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 4;
+    std::uint32_t sample_every = argc > 3 ? std::atoi( argv[3] ) : 16;
+
+    stack_profiler_t off{ 0 };
+    double elapsed = Run( off, count, resumes );
+    std::cout << "Profiling off: " << elapsed << " seconds." << std::endl;
+
+    stack_profiler_t profiler{ sample_every };
+    elapsed = Run( profiler, count, resumes );
+    std::cout << "Profiling 1 in " << sample_every << ": " << elapsed << " seconds." << std::endl;
+    profiler.print( std::cout );
+    return 0;
+}
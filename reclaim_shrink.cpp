@@ -0,0 +1,88 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <time.h>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_reclaimer.hpp"
+
+double ThreadSeconds() {
+    timespec ts;
+    ::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Every tick resumes the next active of count thinks, each consuming 900K, then sleeps out the rest of the
+// tick. Either every think shrinks its own stack before it suspends, or it only parks and the reclaimer
+// thread trims the ones that have been idle for a while. Reports the time the ticks spent resuming thinks, as
+// wall time and as CPU time of the ticking thread; on a machine with a spare core the reclaimer's madvise
+// calls show up in neither, with a single one they still compete for it.
+template< typename Think, typename StackAllocator >
+void RunTicks( const char * name, StackAllocator stack, bool reclaimed, int count, int ticks, int active,
+               std::chrono::milliseconds tick ) {
+    std::vector<Think> thinks;
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [reclaimed]( boost::coroutines2::coroutine< void >::pull_type& c ) {
+            for ( ;; ) {
+                StackConsume( 900 * 1024 );
+                if ( reclaimed ) {
+                    StackPark();
+                } else {
+                    StackShrink();
+                }
+                c();
+            }
+        } );
+    }
+
+    int next = 0;
+    double total = 0, worst = 0, cpu = 0;
+    for ( int t = 0; t < ticks; ++t ) {
+        auto deadline = std::chrono::steady_clock::now() + tick;
+        timer time;
+        time.start();
+        double cpu_start = ThreadSeconds();
+        for ( int i = 0; i < active; ++i ) {
+            thinks[next]();
+            next = (next + 1) % count;
+        }
+        double elapsed = time.stop();
+        cpu += ThreadSeconds() - cpu_start;
+        total += elapsed;
+        worst = std::max( worst, elapsed );
+        std::this_thread::sleep_until( deadline );
+    }
+
+    std::cout << name << std::fixed << std::setprecision( 3 )
+              << " tick: " << total * 1e3 / ticks << " ms mean, " << worst * 1e3 << " ms worst, "
+              << cpu * 1e3 / ticks << " ms cpu, rss: "
+              << std::setprecision( 1 ) << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB" << std::endl;
+    thinks.clear();
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 10'000;
+    int ticks = argc > 2 ? std::atoi( argv[2] ) : 100;
+    int active = argc > 3 ? std::atoi( argv[3] ) : 100;
+    int idle_ms = argc > 4 ? std::atoi( argv[4] ) : 50;
+    size_t stack_size = 1 * 1024 * 1024;
+    const std::chrono::milliseconds tick( 16 );
+
+    RunTicks< boost::coroutines2::coroutine< void >::push_type >( "StackShrink:", reserved_fixedsize_stack{ stack_size },
+                                                                  false, count, ticks, active, tick );
+
+    stack_reclaimer_t reclaimer{ std::chrono::milliseconds( idle_ms ) };
+    RunTicks< reclaimable_coroutine >( "reclaimer:  ", reclaimed_stack< reserved_fixedsize_stack >{ reclaimer, reserved_fixedsize_stack{ stack_size } },
+                                       true, count, ticks, active, tick );
+
+    auto stats = reclaimer.stats();
+    std::cout << "reclaimer: " << stats.passes << " passes, " << stats.reclaimed << " stacks trimmed, "
+              << stats.released_pages << " pages released, " << std::setprecision( 3 ) << stats.busy_s << " seconds busy" << std::endl;
+    return 0;
+}
@@ -0,0 +1,657 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "stack_header.hpp"
+#include "stack_trace.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+
+#define STACK_NOINLINE __declspec(noinline)
+#else
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define STACK_NOINLINE __attribute__((noinline))
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+#endif
+
+// How StackShrink hands back the pages below the stack pointer. Only dontneed makes the next growth fault
+// in fresh zeroed pages every time, the others trade resident memory for a cheaper regrowth.
+enum class stack_release {
+    dontneed,   // release now (MADV_DONTNEED, MEM_DECOMMIT)
+    free,       // release once the system wants them, until then regrowing costs nothing (MADV_FREE, MEM_RESET)
+    cold,       // keep them, but first in line for reclaim (MADV_COLD)
+    pageout,    // reclaim now, which for anonymous memory means swapping it out (MADV_PAGEOUT)
+};
+
+// Which pages an allocator backs its stacks with. Stacks that are shrunk and parked want small pages: with THP
+// set to always the first touch of any stack reservation with a whole huge page in it faults in 2 MiB, and
+// StackShrink only splits that page, its memory stays taken until the kernel comes round to reclaim it. The
+// few long-lived deep stacks, a scheduler's or a thread's own, run faster on huge pages for the dTLB misses
+// they save. Linux only, Windows stacks always use small pages.
+enum class stack_huge_pages {
+    system,         // whatever the transparent huge page setting of the system does
+    never,          // small pages only (MADV_NOHUGEPAGE), for coroutine stacks
+    transparent,    // transparent huge pages where a whole one fits (MADV_HUGEPAGE), i.e. reservations of 2 MiB up
+    hugetlb,        // preallocated pages from the hugetlbfs pool (MAP_HUGETLB), committed on first touch and
+                    // never released until the stack is; transparent if the pool runs dry
+};
+
+#ifdef _WIN32
+STACK_NOINLINE inline PBYTE GetStackPointer() {
+    return (PBYTE)_AddressOfReturnAddress() + 8;
+}
+#else
+STACK_NOINLINE inline PBYTE GetStackPointer() {
+    // the frame address points at the saved frame pointer, the return address sits above it
+    // and the caller's stack pointer right above that
+    return (PBYTE)__builtin_frame_address( 0 ) + 2 * sizeof( void * );
+}
+#endif
+
+inline void StackConsume( PBYTE pPtr, DWORD dwSizeExtra ) {
+    const DWORD page_size = (DWORD)boost::context::stack_traits::page_size();
+    for ( ; dwSizeExtra >= page_size; dwSizeExtra -= page_size ) {
+        // Move our pointer to the next page on the stack.
+        pPtr -= page_size;
+#ifdef _WIN32
+        // read from this pointer. If the page isn't allocated yet - it will be.
+        volatile BYTE nVal = *pPtr;
+#else
+        // write to this pointer, a read would only map the shared zero page on Linux.
+        *(volatile BYTE *)pPtr = 0;
+#endif
+    }
+}
+
+inline void StackConsume( DWORD dwSizeExtra ) {
+    PBYTE pPtr = GetStackPointer();
+    StackConsume( pPtr, dwSizeExtra );
+}
+
+#ifdef _WIN32
+
+inline PBYTE StackShrink( stack_release how = stack_release::dontneed ) {
+    PBYTE sp = GetStackPointer();
+
+    const auto page_size = boost::context::stack_traits::page_size();
+
+    // Round the stack pointer to the next page, add another page extra since our function itself may consume one more page, but not
+    // more than one, let's assume that. This will be the last page we want to be allocated. There will be one more page which will
+    // be the guard page. All the following pages must be freed.
+
+    PBYTE pAllocate = sp - ((uintptr_t)sp & (page_size - 1)) - page_size;
+    PBYTE pGuard    = pAllocate - page_size;
+    PBYTE pFree     = pGuard - page_size;
+
+    // Get the stack last page.
+    MEMORY_BASIC_INFORMATION stMemBasicInfo;
+    BOOST_VERIFY( VirtualQuery( sp, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+
+    // By now stMemBasicInfo.AllocationBase must contain the last (in reverse order) page of the stack.
+    // NOTE - this page acts as a security page, and it is never allocated (committed).
+    // Even if the stack consumes all its thread, and guard attribute is removed from the last accessible page
+    // this page still will be inaccessible.
+
+    // Well, let's see how many pages are left unallocated on the stack.
+    BOOST_VERIFY( VirtualQuery( stMemBasicInfo.AllocationBase, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+    BOOST_ASSERT( stMemBasicInfo.State == MEM_RESERVE );
+
+    PBYTE pFirstAllocated = (PBYTE)stMemBasicInfo.BaseAddress + stMemBasicInfo.RegionSize;
+    if ( how != stack_release::dontneed ) {
+        // The pages stay committed and the guard page stays where the stack got to, so there is nothing to
+        // re-arm. MEM_RESET lets the memory manager drop the contents instead of paging them out. Windows has
+        // no way to only lower their priority, so cold and pageout both trim them from the working set:
+        // VirtualUnlock on pages that are not locked does that, and fails with ERROR_NOT_LOCKED.
+        if ( pFirstAllocated < pAllocate ) {
+            StackTrace( trace_event::shrink, stMemBasicInfo.AllocationBase, (pAllocate - pFirstAllocated) / page_size );
+            if ( how == stack_release::free ) {
+                BOOST_VERIFY( VirtualAlloc( pFirstAllocated, pAllocate - pFirstAllocated, MEM_RESET, PAGE_NOACCESS ) );
+            } else {
+                VirtualUnlock( pFirstAllocated, pAllocate - pFirstAllocated );
+            }
+        }
+        return pFirstAllocated;
+    }
+    if ( pFirstAllocated <= pFree ) {
+        // Obviously the stack doesn't look the way want. Let's fix it. Before we make any modification to the stack let's ensure
+        // that pAllocate page is already allocated, so that there'll be no chance there'll be STATUS_GUARD_PAGE_VIOLATION while
+        // we're fixing the stack and it is inconsistent.
+        volatile BYTE nVal = *pAllocate;
+        // now it is 100% accessible.
+        StackTrace( trace_event::shrink, stMemBasicInfo.AllocationBase, (pGuard - pFirstAllocated) / page_size );
+
+        // Free all the pages up to pFree (including it too).
+        BOOST_VERIFY( VirtualFree( pFirstAllocated, pGuard - pFirstAllocated, MEM_DECOMMIT ) );
+
+        // Make the guard page.
+        BOOST_VERIFY( VirtualAlloc( pGuard, page_size, MEM_COMMIT, PAGE_READWRITE | PAGE_GUARD ) );
+    }
+    return pFirstAllocated;
+}
+
+inline void StackCommit() {
+    PBYTE sp = GetStackPointer();
+
+    const auto page_size = boost::context::stack_traits::page_size();
+
+    // Get the stack last page.
+    MEMORY_BASIC_INFORMATION stMemBasicInfo;
+    BOOST_VERIFY( VirtualQuery( sp, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+    PBYTE pCur = (PBYTE)stMemBasicInfo.BaseAddress;
+
+    // Get the base of the stack
+    // Commit everything except the last page
+    PBYTE pCommit = (PBYTE)stMemBasicInfo.AllocationBase + page_size;
+    if ( pCommit < pCur ) {
+        StackTrace( trace_event::commit, stMemBasicInfo.AllocationBase, (pCur - pCommit) / page_size );
+        BOOST_VERIFY( VirtualAlloc( pCommit, pCur - pCommit, MEM_COMMIT, PAGE_READWRITE ) );
+    }
+}
+
+// Trace a resume or suspend of the calling coroutine (stack_trace.hpp) from its own stack, for coroutines
+// whose resumes are not traced by whoever resumes them: right after it is resumed, right before it suspends.
+inline void StackTraceHere( trace_event event ) {
+    if ( !stack_trace_detail::enabled.load( std::memory_order_relaxed ) ) {
+        return;
+    }
+    MEMORY_BASIC_INFORMATION stMemBasicInfo;
+    BOOST_VERIFY( VirtualQuery( GetStackPointer(), &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+    StackTrace( event, stMemBasicInfo.AllocationBase );
+}
+
+// Decommit everything but the top keep_size bytes of a stack that is not running, re-arming the guard
+// page right below what is kept.
+inline void StackTrim( const boost::context::stack_context & sctx, std::size_t keep_size ) {
+    const auto page_size = boost::context::stack_traits::page_size();
+    PBYTE pTop = static_cast< PBYTE >(sctx.sp);
+    PBYTE pBase = pTop - sctx.size;
+    PBYTE pKeep = pTop - ((keep_size + page_size - 1) & ~(page_size - 1));
+    PBYTE pGuard = pKeep - page_size;
+
+    MEMORY_BASIC_INFORMATION stMemBasicInfo;
+    BOOST_VERIFY( VirtualQuery( pBase, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
+    PBYTE pFirstAllocated = (PBYTE)stMemBasicInfo.BaseAddress + stMemBasicInfo.RegionSize;
+    if ( pBase + page_size < pGuard && pFirstAllocated < pGuard ) {
+        BOOST_VERIFY( VirtualFree( pFirstAllocated, pGuard - pFirstAllocated, MEM_DECOMMIT ) );
+        BOOST_VERIFY( VirtualAlloc( pGuard, page_size, MEM_COMMIT, PAGE_READWRITE | PAGE_GUARD ) );
+    }
+}
+
+class reserved_fixedsize_stack {
+private:
+    std::size_t     size_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    // huge_pages is ignored, Windows stacks are always on small pages
+    reserved_fixedsize_stack( std::size_t size = traits_type::default_size(), stack_huge_pages = stack_huge_pages::never ) BOOST_NOEXCEPT_OR_NOTHROW :
+        size_( size ) {
+    }
+
+    stack_context allocate() {
+        const auto one_page_size = traits_type::page_size();
+        // page at bottom will be used as guard-page
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(size_) / one_page_size )) );
+        BOOST_ASSERT_MSG( 1 <= pages, "at least one page must fit into stack" );
+        const std::size_t size__( pages * one_page_size );
+        BOOST_ASSERT( 0 != size_ && 0 != size__ );
+        BOOST_ASSERT( size__ <= size_ );
+
+        stack_context sctx;
+        void * vp = ::VirtualAlloc( 0, size__, MEM_RESERVE, PAGE_READWRITE );
+        if ( !vp ) goto error;
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        const auto init_commit_size = one_page_size + one_page_size;
+        auto pPtr = static_cast<PBYTE>(vp) + size__;
+        pPtr -= init_commit_size;
+        if ( !VirtualAlloc( pPtr, init_commit_size, MEM_COMMIT, PAGE_READWRITE ) )  goto cleanup;
+
+        // create guard page so the OS can catch page faults and grow our stack
+        pPtr -= one_page_size;
+        if ( !VirtualAlloc( pPtr, one_page_size, MEM_COMMIT, PAGE_READWRITE | PAGE_GUARD ) ) goto cleanup;
+
+        sctx.size = size__;
+        sctx.sp = static_cast<char *>(vp) + sctx.size;
+        StackTrace( trace_event::allocate, vp );
+        return sctx;
+    cleanup:
+        ::VirtualFree( vp, 0, MEM_RELEASE );
+    error:
+        throw std::bad_alloc();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+
+        void * vp = static_cast< char * >(sctx.sp) - sctx.size;
+        ::VirtualFree( vp, 0, MEM_RELEASE );
+    }
+};
+
+#else
+
+// Make [p, p + size) resident in one call, falls back to touching every page on kernels without MADV_POPULATE_WRITE.
+inline void CommitPages( PBYTE p, std::size_t size ) {
+    if ( 0 != ::madvise( p, size, MADV_POPULATE_WRITE ) ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        for ( PBYTE pPage = p; pPage < p + size; pPage += page_size ) {
+            *(volatile BYTE *)pPage = *pPage;
+        }
+    }
+}
+
+// Reserve size bytes of PROT_NONE address space whose end is aligned to align.
+inline PBYTE ReserveAlignedTop( std::size_t size, std::size_t align ) {
+    const std::size_t span = size + align;
+    void * vp = ::mmap( nullptr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if ( vp == MAP_FAILED ) {
+        return nullptr;
+    }
+    PBYTE pBegin = static_cast< PBYTE >(vp);
+    PBYTE pTop = (PBYTE)(((uintptr_t)pBegin + span) & ~(uintptr_t)(align - 1));
+    PBYTE pBase = pTop - size;
+    if ( pBase > pBegin ) {
+        ::munmap( pBegin, pBase - pBegin );
+    }
+    if ( pBegin + span > pTop ) {
+        ::munmap( pTop, pBegin + span - pTop );
+    }
+    return pBase;
+}
+
+// Size of the pages of the hugetlbfs pool MAP_HUGETLB takes from, and of transparent huge pages.
+inline std::size_t HugePageSize() {
+    static const std::size_t size = [] {
+        std::ifstream meminfo( "/proc/meminfo" );
+        for ( std::string line; std::getline( meminfo, line ); ) {
+            if ( 0 == line.compare( 0, 13, "Hugepagesize:" ) ) {
+                return (std::size_t)std::stoull( line.substr( 13 ) ) * 1024;
+            }
+        }
+        return std::size_t( 2 * 1024 * 1024 );
+    }();
+    return size;
+}
+
+// Apply the transparent huge page part of policy to [p, p + size), hugetlb has to be picked when mapping.
+// Kernels without THP have nothing to advise.
+inline void AdviseHugePages( PBYTE p, std::size_t size, stack_huge_pages policy ) {
+    if ( policy == stack_huge_pages::never ) {
+        ::madvise( p, size, MADV_NOHUGEPAGE );
+    } else if ( policy != stack_huge_pages::system ) {
+        ::madvise( p, size, MADV_HUGEPAGE );
+    }
+}
+
+// The stack of the calling thread, [low, high) page aligned, from pthread_getattr_np. For the main thread low
+// is as far as RLIMIT_STACK lets it grow, only the part it ever grew into is mapped.
+struct thread_stack_bounds {
+    PBYTE   low = nullptr;
+    PBYTE   high = nullptr;
+};
+
+// Looked up once per thread, for the main thread pthread_getattr_np has to read /proc/self/maps.
+inline const thread_stack_bounds & ThreadStackBounds() {
+    thread_local const thread_stack_bounds bounds = [] {
+        thread_stack_bounds b;
+        pthread_attr_t attr;
+        if ( 0 != ::pthread_getattr_np( ::pthread_self(), &attr ) ) {
+            return b;
+        }
+        void * addr = nullptr;
+        std::size_t size = 0;
+        if ( 0 == ::pthread_attr_getstack( &attr, &addr, &size ) ) {
+            const auto page_size = boost::context::stack_traits::page_size();
+            b.low = (PBYTE)(((uintptr_t)addr + page_size - 1) & ~(uintptr_t)(page_size - 1));
+            b.high = (PBYTE)(((uintptr_t)addr + size) & ~(uintptr_t)(page_size - 1));
+        }
+        ::pthread_attr_destroy( &attr );
+        return b;
+    }();
+    return bounds;
+}
+
+// Apply policy to the calling thread's own stack, for the threads that run schedulers and other deep, long
+// lived call chains. For the main thread it covers everything the stack may still grow into. hugetlb can only
+// be had for stacks that are mapped that way, it gets transparent huge pages here.
+inline void AdviseThreadStack( stack_huge_pages policy ) {
+    const thread_stack_bounds & bounds = ThreadStackBounds();
+    // the part of the main thread's range that is not mapped yet fails with ENOMEM, the rest is advised
+    if ( bounds.low < bounds.high ) {
+        AdviseHugePages( bounds.low, bounds.high - bounds.low, policy );
+    }
+}
+
+inline stack_header * InitStackHeader( PBYTE base, std::size_t size, std::size_t guard_size ) {
+    auto hdr = new ( base + size - stack_header_size ) stack_header{};
+    hdr->magic = stack_header::magic_value;
+    hdr->self = hdr;
+    hdr->base = base;
+    hdr->size = size;
+    hdr->guard_size = guard_size;
+    StackTrace( trace_event::allocate, base );
+    return hdr;
+}
+
+// Forget everything the last coroutine on a recycled stack left in its header: where it parked, what the
+// shrink passes and StackPrefault learned from it, whether it was running. The next coroutine starts as on a
+// fresh stack. What the allocator keeps there itself, committed and hugetlb, stays.
+inline void ResetStackHeader( stack_header * hdr ) {
+    hdr->parked_sp.store( nullptr, std::memory_order_relaxed );
+    hdr->parks.store( 0, std::memory_order_relaxed );
+    hdr->shrunk_parks = 0;
+    hdr->released_end = nullptr;
+    hdr->state.store( stack_running, std::memory_order_relaxed );
+    hdr->last_resume.store( 0, std::memory_order_relaxed );
+    hdr->prefault = false;
+    hdr->prefaults = 0;
+    hdr->prefault_begin = nullptr;
+    hdr->prefault_end = nullptr;
+}
+
+// Apply how to [pBegin, pEnd). Kernels that do not know the advice get MADV_DONTNEED, the range is dead
+// stack so dropping it is always correct.
+inline void ReleasePages( PBYTE pBegin, PBYTE pEnd, stack_release how ) {
+    int advice = MADV_DONTNEED;
+    switch ( how ) {
+    case stack_release::dontneed: advice = MADV_DONTNEED; break;
+    case stack_release::free:     advice = MADV_FREE; break;
+    case stack_release::cold:     advice = MADV_COLD; break;
+    case stack_release::pageout:  advice = MADV_PAGEOUT; break;
+    }
+    if ( 0 != ::madvise( pBegin, pEnd - pBegin, advice ) ) {
+        BOOST_VERIFY( 0 == ::madvise( pBegin, pEnd - pBegin, MADV_DONTNEED ) );
+    }
+}
+
+// Lowest page in [lo, hi) that is resident, hi if none is.
+inline PBYTE LowestResidentPage( PBYTE lo, PBYTE hi ) {
+    const auto page_size = boost::context::stack_traits::page_size();
+    unsigned char vec[256];
+    while ( lo < hi ) {
+        const std::size_t pages = std::min< std::size_t >( (hi - lo) / page_size, sizeof( vec ) );
+        if ( 0 != ::mincore( lo, pages * page_size, vec ) ) {
+            return hi;
+        }
+        for ( std::size_t i = 0; i < pages; ++i, lo += page_size ) {
+            if ( vec[i] & 1 ) {
+                return lo;
+            }
+        }
+    }
+    return hi;
+}
+
+// ReleasePages for a range of hdr's stack. A file backed stack's pages are dropped from the file whatever how
+// asks for, writing dead stack back to disk or keeping it cached is never worth it. hugetlb stacks keep theirs.
+inline void ReleaseStackPages( const stack_header & hdr, PBYTE pBegin, PBYTE pEnd, stack_release how = stack_release::dontneed ) {
+    if ( hdr.hugetlb ) {
+        return;
+    }
+    if ( hdr.file_backed ) {
+        BOOST_VERIFY( 0 == ::madvise( pBegin, pEnd - pBegin, MADV_REMOVE ) );
+        return;
+    }
+    ReleasePages( pBegin, pEnd, how );
+}
+
+inline PBYTE StackShrink( stack_release how = stack_release::dontneed ) {
+    PBYTE sp = GetStackPointer();
+
+    const auto page_size = boost::context::stack_traits::page_size();
+
+    // Keep the page the stack pointer is in and one more below it for the calls we are about to make,
+    // everything between the guard region and that page goes back to the kernel. The guard region itself
+    // never moves on Linux, the kernel faults pages back in on demand when the stack grows again.
+    PBYTE pAllocate = sp - ((uintptr_t)sp & (page_size - 1)) - page_size;
+
+    stack_header * hdr = find_stack_header( sp );
+    BOOST_ASSERT_MSG( hdr, "StackShrink called outside of a reserved stack" );
+
+    PBYTE pFirstAllocated = hdr->usable();
+    if ( PBYTE pCommitted = hdr->committed.load( std::memory_order_relaxed ) ) {
+        pFirstAllocated = pCommitted;
+    }
+    if ( pFirstAllocated < pAllocate ) {
+        if ( hdr->release_hook ) {
+            hdr->release_hook( *hdr, pFirstAllocated, pAllocate );
+        }
+        StackTrace( trace_event::shrink, hdr->base, (pAllocate - pFirstAllocated) / page_size );
+        if ( hdr->prefault && how == stack_release::dontneed ) {
+            // everything down there was released last time, so what is resident now is what this run used,
+            // plus whatever StackPrefault committed for it
+            PBYTE pLowest = LowestResidentPage( pFirstAllocated, pAllocate );
+            hdr->prefault_begin = pLowest < pAllocate ? pLowest : nullptr;
+            hdr->prefault_end = pLowest < pAllocate ? pAllocate : nullptr;
+        }
+    }
+    if ( hdr->committed.load( std::memory_order_relaxed ) ) {
+        // the stack grows through a fault handler, hand the pages back and take the access away again so
+        // the next growth faults. Remember how far it went so that fault can commit it all in one go.
+        if ( how != stack_release::dontneed ) {
+            // the pages stay accessible, only their backing is advised
+            if ( pFirstAllocated < pAllocate ) {
+                ReleasePages( pFirstAllocated, pAllocate, how );
+            }
+            return pFirstAllocated;
+        }
+        if ( pFirstAllocated < pAllocate ) {
+            BOOST_VERIFY( 0 == ::mprotect( pFirstAllocated, pAllocate - pFirstAllocated, PROT_NONE ) );
+            BOOST_VERIFY( 0 == ::madvise( pFirstAllocated, pAllocate - pFirstAllocated, MADV_DONTNEED ) );
+            hdr->grow_pages.store( (std::uint32_t)((pAllocate - pFirstAllocated) / page_size ), std::memory_order_relaxed );
+            hdr->committed.store( pAllocate, std::memory_order_relaxed );
+        }
+        return pFirstAllocated;
+    }
+    if ( pFirstAllocated < pAllocate ) {
+        ReleaseStackPages( *hdr, pFirstAllocated, pAllocate, how );
+    }
+    return pFirstAllocated;
+}
+
+inline void StackCommit() {
+    PBYTE sp = GetStackPointer();
+
+    const auto page_size = boost::context::stack_traits::page_size();
+
+    stack_header * hdr = find_stack_header( sp );
+    BOOST_ASSERT_MSG( hdr, "StackCommit called outside of a reserved stack" );
+
+    // Commit everything from the guard region up to the current page
+    PBYTE pCur = sp - ((uintptr_t)sp & (page_size - 1));
+    PBYTE pCommit = hdr->usable();
+    if ( pCommit < pCur ) {
+        StackTrace( trace_event::commit, hdr->base, (pCur - pCommit) / page_size );
+        CommitPages( pCommit, pCur - pCommit );
+    }
+}
+
+// Every this many StackPrefault calls one does nothing, the pages it would have committed look used to the
+// next StackShrink, so without a run on its own a coroutine that got shallower would never be noticed.
+constexpr std::uint32_t stack_prefault_probe_every = 16;
+
+// Commit the pages the coroutine on a suspended stack used below its kept top the last time it ran, as
+// StackShrink found them, in one call instead of a page fault per page. Call right before resuming it.
+// Turns the recording in StackShrink on for the stack, so the first call commits nothing; the depth only
+// follows stacks shrunk with stack_release::dontneed. Not for the fault grown stacks, they have grow_pages.
+inline void StackPrefault( stack_header * hdr ) {
+    BOOST_ASSERT_MSG( !hdr->committed.load( std::memory_order_relaxed ), "fault grown stacks commit on their own" );
+    hdr->prefault = true;
+    if ( hdr->prefaults++ % stack_prefault_probe_every == 0 || !hdr->prefault_begin ) {
+        return;
+    }
+    const auto page_size = boost::context::stack_traits::page_size();
+    StackTrace( trace_event::commit, hdr->base, (hdr->prefault_end - hdr->prefault_begin) / page_size );
+    CommitPages( hdr->prefault_begin, hdr->prefault_end - hdr->prefault_begin );
+}
+
+// StackPrefault from the coroutine itself, first thing after it was resumed.
+inline void StackPrefault() {
+    stack_header * hdr = find_stack_header( GetStackPointer() );
+    BOOST_ASSERT_MSG( hdr, "StackPrefault called outside of a reserved stack" );
+    StackPrefault( hdr );
+}
+
+// Record the calling coroutine's stack pointer right before it suspends, so that passes over parked stacks
+// (soft_dirty_shrinker_t, stack_reclaimer_t) know which part of its stack is live until StackBeginResume.
+inline void StackPark() {
+    PBYTE sp = GetStackPointer();
+    stack_header * hdr = find_stack_header( sp );
+    BOOST_ASSERT_MSG( hdr, "StackPark called outside of a reserved stack" );
+    hdr->parked_sp.store( sp, std::memory_order_relaxed );
+    // only the coroutine itself ever writes it
+    hdr->parks.store( hdr->parks.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+}
+
+// Call right before resuming a coroutine whose parked stack is trimmed by anything but the coroutine itself,
+// a stack_reclaimer_t or a soft_dirty_shrinker_t. Waits for a reclaim that is releasing its pages to finish,
+// then marks it running and forgets where it parked: if it suspends again without calling StackPark, its
+// frames may be anywhere below the old park point.
+inline void StackBeginResume( stack_header * hdr ) {
+    std::uint32_t expected = stack_parked;
+    while ( !hdr->state.compare_exchange_weak( expected, stack_running, std::memory_order_acquire, std::memory_order_relaxed ) ) {
+        if ( expected == stack_running ) {
+            break;
+        }
+        // a reclaim takes one madvise, yield rather than spin through it
+        std::this_thread::yield();
+        expected = stack_parked;
+    }
+    hdr->parked_sp.store( nullptr, std::memory_order_relaxed );
+    hdr->last_resume.store( std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed );
+}
+
+// Call once the coroutine suspended again, from then on a reclaimer may trim it. Only stacks the coroutine
+// called StackPark on are ever trimmed.
+inline void StackEndResume( stack_header * hdr ) {
+    hdr->state.store( stack_parked, std::memory_order_release );
+}
+
+// Trace a resume or suspend of the calling coroutine (stack_trace.hpp) from its own stack, for coroutines
+// whose resumes are not traced by whoever resumes them: right after it is resumed, right before it suspends.
+inline void StackTraceHere( trace_event event ) {
+    if ( !stack_trace_detail::enabled.load( std::memory_order_relaxed ) ) {
+        return;
+    }
+    stack_header * hdr = find_stack_header( GetStackPointer() );
+    BOOST_ASSERT_MSG( hdr, "StackTraceHere called outside of a reserved stack" );
+    StackTrace( event, hdr->base );
+}
+
+// Release everything but the top keep_size bytes of a stack that is not running.
+inline void StackTrim( const boost::context::stack_context & sctx, std::size_t keep_size ) {
+    const auto page_size = boost::context::stack_traits::page_size();
+    auto hdr = static_cast< stack_header * >(sctx.sp);
+    PBYTE pKeep = hdr->top() - ((keep_size + page_size - 1) & ~(page_size - 1));
+    if ( hdr->usable() < pKeep ) {
+        ReleaseStackPages( *hdr, hdr->usable(), pKeep );
+    }
+}
+
+class reserved_fixedsize_stack {
+private:
+    std::size_t         size_;
+    stack_huge_pages    huge_pages_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    reserved_fixedsize_stack( std::size_t size = traits_type::default_size(),
+                              stack_huge_pages huge_pages = stack_huge_pages::never ) BOOST_NOEXCEPT_OR_NOTHROW :
+        size_( size ), huge_pages_( huge_pages ) {
+    }
+
+    stack_context allocate() {
+        const auto one_page_size = traits_type::page_size();
+        // page at bottom will be used as guard-page
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(size_) / one_page_size )) );
+        BOOST_ASSERT_MSG( 2 <= pages, "at least two pages must fit into stack" );
+        std::size_t size__( pages * one_page_size );
+        BOOST_ASSERT( 0 != size_ && 0 != size__ );
+        BOOST_ASSERT( size__ <= size_ );
+
+        bool hugetlb = false;
+        if ( huge_pages_ == stack_huge_pages::hugetlb ) {
+            // hugetlb pages can not be split, the part above the guard page becomes whole ones
+            const std::size_t huge_page_size = HugePageSize();
+            size__ = ((size__ - one_page_size + huge_page_size - 1) & ~(huge_page_size - 1)) + one_page_size;
+        }
+
+        PBYTE vp = ReserveAlignedTop( size__, stack_alignment( size__ ) );
+        if ( !vp ) throw std::bad_alloc();
+
+        if ( huge_pages_ == stack_huge_pages::hugetlb ) {
+            // the top is aligned to at least the huge page size, so is the usable part below it. A pool that
+            // runs dry fails the mmap after the reservation under it is gone already, map it back plain.
+            hugetlb = MAP_FAILED != ::mmap( vp + one_page_size, size__ - one_page_size, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0 );
+            if ( !hugetlb && MAP_FAILED == ::mmap( vp + one_page_size, size__ - one_page_size, PROT_NONE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0 ) ) {
+                ::munmap( vp, size__ );
+                throw std::bad_alloc();
+            }
+        }
+        // everything above the guard page becomes accessible, MAP_NORESERVE keeps it from being charged
+        // until the kernel faults the pages in
+        if ( !hugetlb ) {
+            if ( 0 != ::mprotect( vp + one_page_size, size__ - one_page_size, PROT_READ | PROT_WRITE ) ) {
+                ::munmap( vp, size__ );
+                throw std::bad_alloc();
+            }
+            AdviseHugePages( vp + one_page_size, size__ - one_page_size, huge_pages_ );
+        }
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        const auto init_commit_size = one_page_size + one_page_size;
+        CommitPages( vp + size__ - init_commit_size, init_commit_size );
+
+        stack_header * hdr = InitStackHeader( vp, size__, one_page_size );
+        hdr->hugetlb = hugetlb;
+
+        stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        BOOST_ASSERT( hdr->self == hdr );
+        ::munmap( hdr->base, hdr->size );
+    }
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "think_scheduler.hpp"
+
+using think_co = think_scheduler_t::think_co;
+
+// Spawn count thinks that each run the 900K workload resumes times and then finish, and drive them to
+// completion on num_workers threads. Returns the seconds spent in the rounds.
+double RunScheduled( std::size_t num_workers, int count, int resumes, size_t stack_size, bool report ) {
+    think_scheduler_t scheduler{ num_workers, stack_size };
+    for ( int i = 0; i < count; ++i ) {
+        scheduler.spawn( [resumes]( think_co::pull_type& c ) {
+            for ( int n = 0; n < resumes; ++n ) {
+                StackConsume( 900 * 1024 );
+                StackShrink();
+                c();
+            }
+        } );
+    }
+
+    timer time;
+    time.start();
+    // the first round only starts them, the last one lets them finish
+    for ( int n = 0; n <= resumes; ++n ) {
+        scheduler.run_round();
+    }
+    double elapsed = time.stop();
+
+    if ( report ) {
+        for ( std::size_t i = 0; i < scheduler.num_workers(); ++i ) {
+            auto s = scheduler.worker_stats( i );
+            std::cout << "  worker " << std::setw( 2 ) << i
+                      << ": resumes " << std::setw( 8 ) << s.resumes
+                      << ", steals " << std::setw( 6 ) << s.steals
+                      << " (" << s.stolen << " stolen, " << s.failed_steals << " failed)"
+                      << ", finished " << s.finished
+                      << ", pool " << s.pool.pool_size << " (hit rate " << std::fixed << std::setprecision( 2 )
+                      << s.pool.hit_rate() << ")" << std::endl;
+        }
+    }
+    return elapsed;
+}
+
+int main( int argc, char ** argv ) {
+    // every think is spawned up front on a reserved stack from its worker's pool, guard and stack are two
+    // mappings, so all of them live at once have to stay below half of vm.max_map_count
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 2;
+    std::size_t num_workers = argc > 3 ? std::atoi( argv[3] ) : std::thread::hardware_concurrency();
+    size_t stack_size = 1 * 1024 * 1024;
+
+    double single = RunScheduled( 1, count, resumes, stack_size, false );
+    std::cout << "1 worker: Thought for " << single << " seconds." << std::endl;
+
+    double multi = RunScheduled( num_workers, count, resumes, stack_size, true );
+    std::cout << num_workers << " workers: Thought for " << multi << " seconds, speedup "
+              << std::fixed << std::setprecision( 2 ) << single / multi << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "segv_stack.hpp"
+
+int main( int argc, char ** argv ) {
+    using think_co = boost::coroutines2::coroutine< void >;
+    // the PROT_NONE part below what a stack has committed is a mapping apart from the committed part, every
+    // think costs two of the 65530 vm.max_map_count allows by default
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 2;
+    size_t grow_pages = argc > 3 ? std::atoi( argv[3] ) : 4;
+    size_t stack_size = 1 * 1024 * 1024;
+    std::vector<think_co::push_type> thinks;
+
+    segv_stack_space_t space{ stack_size, 2, grow_pages };
+    segv_fixedsize_stack stack{ space };
+    thinks.reserve( count );
+
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [&]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                StackConsume( 900 * 1024 );
+                StackShrink();
+                c();
+            }
+        } );
+    }
+
+    timer time;
+    std::uint64_t faults = segv_stack_space_t::growth_faults();
+    for ( int n = 0; n < resumes; ++n ) {
+        time.start();
+        for ( auto & think : thinks ) {
+            think();
+        }
+        double elapsed = time.stop();
+        std::uint64_t now = segv_stack_space_t::growth_faults();
+        std::cout << "resume " << n << ": " << elapsed << " seconds, "
+                  << (double)(now - faults) / count << " growth faults per think" << std::endl;
+        faults = now;
+    }
+
+    return 0;
+}
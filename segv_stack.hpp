@@ -0,0 +1,275 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "reserved_stack.hpp"
+
+namespace segv_stack_detail {
+
+// Alignments of every live segv_stack_space_t, the handler probes for a stack header at each of them.
+constexpr std::size_t max_alignments = 8;
+inline std::atomic< std::size_t > alignments[max_alignments];
+inline std::atomic< std::uint64_t > growth_faults{ 0 };
+inline struct sigaction previous_action;
+inline std::once_flag install_once;
+
+constexpr std::size_t alt_stack_size = 64 * 1024;
+
+// Copy a candidate header without touching it, the fault address may be anywhere and the memory above it
+// need not be mapped. process_vm_readv reports EFAULT instead of raising another SIGSEGV.
+inline bool ProbeStackHeader( stack_header * candidate, stack_header * copy ) {
+    iovec local = { copy, sizeof( stack_header ) };
+    iovec remote = { candidate, sizeof( stack_header ) };
+    return (ssize_t)sizeof( stack_header ) == ::process_vm_readv( ::getpid(), &local, 1, &remote, 1, 0 );
+}
+
+inline stack_header * FindGrowableStack( PBYTE pAddress ) {
+    for ( auto & slot : alignments ) {
+        const std::size_t align = slot.load( std::memory_order_acquire );
+        if ( !align ) {
+            continue;
+        }
+        PBYTE top = (PBYTE)(((std::uintptr_t)pAddress + align) & ~(std::uintptr_t)(align - 1));
+        auto candidate = reinterpret_cast< stack_header * >(top - stack_header_size);
+        alignas( stack_header ) unsigned char buffer[sizeof( stack_header )];
+        auto copy = reinterpret_cast< stack_header * >(buffer);
+        if ( !ProbeStackHeader( candidate, copy ) ) {
+            continue;
+        }
+        if ( copy->magic != stack_header::magic_value || copy->self != candidate || copy->top() != top ) {
+            continue;
+        }
+        return candidate;
+    }
+    return nullptr;
+}
+
+// Hand a fault we do not own to whoever was installed before us. Falling back to the default action and
+// returning re-executes the faulting instruction, which then dies the usual way.
+inline void ChainSignal( int sig, siginfo_t * info, void * context ) {
+    if ( previous_action.sa_flags & SA_SIGINFO ) {
+        if ( previous_action.sa_sigaction ) {
+            previous_action.sa_sigaction( sig, info, context );
+            return;
+        }
+    } else if ( previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN ) {
+        previous_action.sa_handler( sig );
+        return;
+    }
+    ::signal( sig, SIG_DFL );
+}
+
+inline void OnSegv( int sig, siginfo_t * info, void * context ) {
+    const int saved_errno = errno;
+    const auto page_size = boost::context::stack_traits::page_size();
+    PBYTE pAddress = (PBYTE)info->si_addr;
+
+    stack_header * hdr = info->si_code == SEGV_ACCERR ? FindGrowableStack( pAddress ) : nullptr;
+    PBYTE pCommitted = hdr ? hdr->committed.load( std::memory_order_relaxed ) : nullptr;
+    if ( !pCommitted || pAddress < hdr->usable() || pAddress >= pCommitted ) {
+        // not ours, or a real overflow into the guard region
+        errno = saved_errno;
+        ChainSignal( sig, info, context );
+        return;
+    }
+
+    // commit at least down to the faulting page, and as much as the stack grew last time if that is more
+    PBYTE pPage = pAddress - ((std::uintptr_t)pAddress & (page_size - 1));
+    std::size_t pages = std::max< std::size_t >( (pCommitted - pPage) / page_size,
+                                                 hdr->grow_pages.load( std::memory_order_relaxed ) );
+    pages = std::min< std::size_t >( pages, (pCommitted - hdr->usable()) / page_size );
+    PBYTE pBegin = pCommitted - pages * page_size;
+    if ( 0 != ::mprotect( pBegin, pCommitted - pBegin, PROT_READ | PROT_WRITE ) ) {
+        errno = saved_errno;
+        ChainSignal( sig, info, context );
+        return;
+    }
+    hdr->committed.store( pBegin, std::memory_order_relaxed );
+
+    // growing again within the same run, the next step doubles
+    hdr->grow_pages.store( (std::uint32_t)(pages * 2), std::memory_order_relaxed );
+    hdr->faults.fetch_add( 1, std::memory_order_relaxed );
+    PBYTE deepest = hdr->deepest.load( std::memory_order_relaxed );
+    if ( !deepest || pBegin < deepest ) {
+        hdr->deepest.store( pBegin, std::memory_order_relaxed );
+    }
+    growth_faults.fetch_add( 1, std::memory_order_relaxed );
+    StackTraceNoAlloc( trace_event::guard_hit, hdr->base, pages );
+    errno = saved_errno;
+}
+
+struct alt_stack_t {
+    void * mem = nullptr;
+
+    ~alt_stack_t() {
+        if ( mem ) {
+            stack_t ss = {};
+            ss.ss_flags = SS_DISABLE;
+            ::sigaltstack( &ss, nullptr );
+            ::munmap( mem, alt_stack_size );
+        }
+    }
+};
+
+}
+
+// Stacks that start with only their top few pages accessible, the rest down to the guard page stays
+// PROT_NONE. Running into it raises SIGSEGV, and a handler on the thread's sigaltstack recognises the address
+// as a growable stack by its header and opens up the next pages with a single mprotect. The step doubles with
+// every fault of a run and starts from what the last StackShrink released, so a coroutine that went 900KiB
+// deep last time gets all of it back in one fault instead of 225. StackShrink takes the access away again
+// along with the pages. Faults that are not on a growable stack, including overflows into the guard page,
+// go to the handler that was installed before.
+//
+// Every thread that resumes these coroutines needs an alternate signal stack, the faulting stack has no
+// room for the signal frame. allocate() sets one up for the calling thread, other threads call
+// prepare_thread() first.
+class segv_stack_space_t {
+public:
+    segv_stack_space_t( std::size_t stack_size, std::size_t init_pages = 2, std::size_t grow_pages = 4 ) :
+        init_pages_( std::max< std::size_t >( init_pages, 1 ) ),
+        grow_pages_( std::max< std::size_t >( grow_pages, 1 ) ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(stack_size) / page_size )) );
+        BOOST_ASSERT_MSG( init_pages_ + 1 <= pages, "the guard and the initial commit must fit into stack" );
+        size_ = pages * page_size;
+        align_ = stack_alignment( size_ );
+
+        std::call_once( segv_stack_detail::install_once, [] {
+            struct sigaction sa = {};
+            sa.sa_sigaction = &segv_stack_detail::OnSegv;
+            sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset( &sa.sa_mask );
+            if ( 0 != ::sigaction( SIGSEGV, &sa, &segv_stack_detail::previous_action ) ) {
+                throw std::system_error( errno, std::system_category(), "sigaction" );
+            }
+        } );
+        register_alignment();
+    }
+
+    ~segv_stack_space_t() {
+        // the handler stays installed, it chains everything once no alignment is registered
+        slot_->store( 0, std::memory_order_release );
+    }
+
+    segv_stack_space_t( const segv_stack_space_t & ) = delete;
+    segv_stack_space_t & operator=( const segv_stack_space_t & ) = delete;
+
+    // Give the calling thread an alternate signal stack unless it already has one.
+    static void prepare_thread() {
+        thread_local segv_stack_detail::alt_stack_t alt;
+        if ( alt.mem ) {
+            return;
+        }
+        stack_t current = {};
+        if ( 0 == ::sigaltstack( nullptr, &current ) && !(current.ss_flags & SS_DISABLE) ) {
+            return;
+        }
+        void * mem = ::mmap( nullptr, segv_stack_detail::alt_stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( mem == MAP_FAILED ) throw std::bad_alloc();
+        stack_t ss = {};
+        ss.ss_sp = mem;
+        ss.ss_size = segv_stack_detail::alt_stack_size;
+        if ( 0 != ::sigaltstack( &ss, nullptr ) ) {
+            ::munmap( mem, segv_stack_detail::alt_stack_size );
+            throw std::system_error( errno, std::system_category(), "sigaltstack" );
+        }
+        alt.mem = mem;
+    }
+
+    boost::context::stack_context allocate() {
+        prepare_thread();
+        const auto page_size = boost::context::stack_traits::page_size();
+
+        PBYTE vp = ReserveAlignedTop( size_, align_ );
+        if ( !vp ) throw std::bad_alloc();
+
+        const auto init_commit_size = init_pages_ * page_size;
+        PBYTE pCommitted = vp + size_ - init_commit_size;
+        if ( 0 != ::mprotect( pCommitted, init_commit_size, PROT_READ | PROT_WRITE ) ) {
+            ::munmap( vp, size_ );
+            throw std::bad_alloc();
+        }
+        CommitPages( pCommitted, init_commit_size );
+        stack_header * hdr = InitStackHeader( vp, size_, page_size );
+        hdr->grow_pages.store( (std::uint32_t)grow_pages_, std::memory_order_relaxed );
+        hdr->committed.store( pCommitted, std::memory_order_relaxed );
+
+        boost::context::stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( boost::context::stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        BOOST_ASSERT( hdr->self == hdr );
+        ::munmap( hdr->base, hdr->size );
+    }
+
+    // Growth faults served so far, over all spaces.
+    static std::uint64_t growth_faults() {
+        return segv_stack_detail::growth_faults.load( std::memory_order_relaxed );
+    }
+
+    std::size_t get_stack_size() const { return size_; }
+
+private:
+    void register_alignment() {
+        for ( auto & slot : segv_stack_detail::alignments ) {
+            std::size_t expected = 0;
+            if ( slot.compare_exchange_strong( expected, align_, std::memory_order_acq_rel ) ) {
+                slot_ = &slot;
+                return;
+            }
+        }
+        throw std::runtime_error( "too many segv_stack_space_t alive" );
+    }
+
+    std::size_t                     size_;
+    std::size_t                     align_;
+    std::size_t                     init_pages_;
+    std::size_t                     grow_pages_;
+    std::atomic< std::size_t > *    slot_ = nullptr;
+};
+
+// StackAllocator handle onto a segv_stack_space_t.
+class segv_fixedsize_stack {
+private:
+    segv_stack_space_t * space_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    segv_fixedsize_stack( segv_stack_space_t & space ) BOOST_NOEXCEPT_OR_NOTHROW :
+        space_( &space ) {
+    }
+
+    stack_context allocate() {
+        return space_->allocate();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        space_->deallocate( sctx );
+    }
+};
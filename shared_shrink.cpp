@@ -0,0 +1,133 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "shared_stack.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+struct bench_result {
+    double parked_bytes;    // resident bytes per parked coroutine
+    double think_ns;        // per resume of the 900K think
+    double switch_ns;       // per resume + suspend of an empty think
+};
+
+void Report( const char * which, const bench_result & r ) {
+    std::cout << std::left << std::setw( 10 ) << which << std::right << std::fixed
+              << " parked: " << std::setprecision( 0 ) << std::setw( 8 ) << r.parked_bytes << " bytes"
+              << " think: " << std::setprecision( 1 ) << std::setw( 10 ) << r.think_ns << " ns"
+              << " switch: " << std::setprecision( 1 ) << std::setw( 8 ) << r.switch_ns << " ns" << std::endl;
+}
+
+bench_result RunReserved( int count, int resumes, size_t stack_size ) {
+    bench_result r;
+    reserved_fixedsize_stack stack{ stack_size };
+    {
+        std::vector<think_co::push_type> thinks;
+        thinks.reserve( count );
+        std::size_t rss = ProcessResidentBytes();
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( stack,
+            [&]( think_co::pull_type& c ) {
+                for ( ;; ) {
+                    StackConsume( 900 * 1024 );
+                    StackShrink();
+                    c();
+                }
+            } );
+        }
+        timer time;
+        time.start();
+        for ( int n = 0; n < resumes; ++n ) {
+            for ( auto & think : thinks ) {
+                think();
+            }
+        }
+        r.think_ns = time.stop() * 1e9 / ((double)count * resumes);
+        r.parked_bytes = ((double)ProcessResidentBytes() - rss) / count;
+    }
+    {
+        std::vector<think_co::push_type> thinks;
+        thinks.reserve( count );
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( stack, [&]( think_co::pull_type& c ) { for ( ;; ) c(); } );
+        }
+        timer time;
+        time.start();
+        for ( int n = 0; n < resumes; ++n ) {
+            for ( auto & think : thinks ) {
+                think();
+            }
+        }
+        r.switch_ns = time.stop() * 1e9 / ((double)count * resumes);
+    }
+    return r;
+}
+
+bench_result RunShared( int count, int resumes, size_t stack_size ) {
+    bench_result r;
+    shared_stack_t stack{ stack_size };
+    {
+        std::vector<std::unique_ptr<copy_coroutine>> thinks;
+        thinks.reserve( count );
+        std::size_t rss = ProcessResidentBytes();
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( new copy_coroutine( stack,
+            [&]( copy_coroutine& c ) {
+                for ( ;; ) {
+                    StackConsume( 900 * 1024 );
+                    c.yield();
+                }
+            } ) );
+        }
+        timer time;
+        time.start();
+        for ( int n = 0; n < resumes; ++n ) {
+            for ( auto & think : thinks ) {
+                (*think)();
+            }
+        }
+        r.think_ns = time.stop() * 1e9 / ((double)count * resumes);
+        r.parked_bytes = ((double)ProcessResidentBytes() - rss) / count;
+
+        std::size_t saved = 0;
+        for ( auto & think : thinks ) {
+            saved += think->saved_bytes();
+        }
+        std::cout << "shared: " << (double)saved / count << " live bytes saved per parked coroutine" << std::endl;
+    }
+    {
+        std::vector<std::unique_ptr<copy_coroutine>> thinks;
+        thinks.reserve( count );
+        for ( int i = 0; i < count; ++i ) {
+            thinks.emplace_back( new copy_coroutine( stack, [&]( copy_coroutine& c ) { for ( ;; ) c.yield(); } ) );
+        }
+        timer time;
+        time.start();
+        for ( int n = 0; n < resumes; ++n ) {
+            for ( auto & think : thinks ) {
+                (*think)();
+            }
+        }
+        r.switch_ns = time.stop() * 1e9 / ((double)count * resumes);
+    }
+    return r;
+}
+
+int main( int argc, char ** argv ) {
+    // the shared run needs one stack however many thinks there are, the reserved run it is compared with
+    // needs a reservation of two mappings for each of them, and that is what vm.max_map_count limits
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 4;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    Report( "reserved", RunReserved( count, resumes, stack_size ) );
+    Report( "shared", RunShared( count, resumes, stack_size ) );
+
+    return 0;
+}
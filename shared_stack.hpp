@@ -0,0 +1,137 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/context/detail/fcontext.hpp>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "reserved_stack.hpp"
+
+class copy_coroutine;
+
+// One large execution stack that copy_coroutine instances take turns running on. Only one coroutine can
+// run on it at a time, so use one per thread.
+class shared_stack_t {
+public:
+    shared_stack_t( std::size_t stack_size ) : alloc_( stack_size ), sctx_( alloc_.allocate() ) {
+    }
+
+    ~shared_stack_t() {
+        alloc_.deallocate( sctx_ );
+    }
+
+    shared_stack_t( const shared_stack_t & ) = delete;
+    shared_stack_t & operator=( const shared_stack_t & ) = delete;
+
+    PBYTE top() const { return static_cast< PBYTE >(sctx_.sp); }
+    std::size_t size() const { return sctx_.size; }
+
+private:
+    friend class copy_coroutine;
+
+    reserved_fixedsize_stack        alloc_;
+    boost::context::stack_context   sctx_;
+    copy_coroutine *                owner_ = nullptr;   // whose frames are currently on the stack
+};
+
+// A coroutine that runs on a shared_stack_t. When it suspends, the live bytes between its stack pointer and
+// the top of the shared stack are copied into a heap save area of exactly that size. They are copied back
+// before it resumes, unless nobody else used the shared stack in between. Destroying a coroutine that has
+// not finished drops its frames without unwinding them.
+class copy_coroutine {
+public:
+    template< typename Fn >
+    copy_coroutine( shared_stack_t & stack, Fn && fn ) :
+        stack_( &stack ), fn_( std::forward< Fn >( fn ) ) {
+    }
+
+    ~copy_coroutine() {
+        if ( stack_->owner_ == this ) {
+            stack_->owner_ = nullptr;
+        }
+        std::free( save_ );
+    }
+
+    copy_coroutine( const copy_coroutine & ) = delete;
+    copy_coroutine & operator=( const copy_coroutine & ) = delete;
+
+    // Run until the coroutine yields or returns. Must be called from outside the shared stack.
+    void operator()() {
+        BOOST_ASSERT_MSG( !done_, "resuming a finished coroutine" );
+        namespace ctx = boost::context::detail;
+
+        if ( !fctx_ ) {
+            fctx_ = ctx::make_fcontext( stack_->top(), stack_->size(), &entry );
+        } else if ( stack_->owner_ != this ) {
+            std::memcpy( stack_->top() - save_size_, save_, save_size_ );
+        }
+        stack_->owner_ = this;
+
+        ctx::transfer_t t = ctx::jump_fcontext( fctx_, this );
+        fctx_ = t.fctx;
+
+        if ( done_ ) {
+            stack_->owner_ = nullptr;
+            std::free( save_ );
+            save_ = nullptr;
+            save_size_ = 0;
+            if ( except_ ) {
+                std::rethrow_exception( std::exchange( except_, nullptr ) );
+            }
+            return;
+        }
+        save();
+    }
+
+    // Suspend back to whoever resumed us. Must be called from inside the coroutine.
+    void yield() {
+        namespace ctx = boost::context::detail;
+        ctx::transfer_t t = ctx::jump_fcontext( caller_, nullptr );
+        caller_ = t.fctx;
+    }
+
+    explicit operator bool() const { return !done_; }
+
+    // heap bytes held while parked
+    std::size_t saved_bytes() const { return save_size_; }
+
+private:
+    static void entry( boost::context::detail::transfer_t t ) {
+        auto self = static_cast< copy_coroutine * >(t.data);
+        self->caller_ = t.fctx;
+        try {
+            self->fn_( *self );
+        } catch ( ... ) {
+            self->except_ = std::current_exception();
+        }
+        self->done_ = true;
+        boost::context::detail::jump_fcontext( self->caller_, nullptr );
+        BOOST_ASSERT_MSG( false, "finished coroutine resumed" );
+    }
+
+    void save() {
+        // the suspended context sits at the coroutine's stack pointer, everything above it is live
+        const std::size_t live = stack_->top() - static_cast< PBYTE >(fctx_);
+        if ( live != save_size_ ) {
+            void * p = std::realloc( save_, live );
+            if ( !p ) throw std::bad_alloc();
+            save_ = static_cast< BYTE * >(p);
+            save_size_ = live;
+        }
+        std::memcpy( save_, stack_->top() - live, live );
+    }
+
+    shared_stack_t *                        stack_;
+    std::function< void( copy_coroutine & ) > fn_;
+    boost::context::detail::fcontext_t      fctx_ = nullptr;
+    boost::context::detail::fcontext_t      caller_ = nullptr;
+    BYTE *                                  save_ = nullptr;
+    std::size_t                             save_size_ = 0;
+    std::exception_ptr                      except_;
+    bool                                    done_ = false;
+};
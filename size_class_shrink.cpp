@@ -0,0 +1,100 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <random>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "pooled_stack.hpp"
+#include "size_class_stack.hpp"
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+// Three kinds of entities: most of them think shallow, some patrol a little deeper and one in sixteen runs
+// the 900 KiB pathfinder.
+enum think_kind { think_shallow, think_patrol, think_pathfind };
+
+think_kind KindOf( int i ) {
+    return i % 16 == 0 ? think_pathfind : i % 4 == 0 ? think_patrol : think_shallow;
+}
+
+DWORD DepthOf( think_kind kind, std::minstd_rand & rng ) {
+    switch ( kind ) {
+    case think_shallow: return 2 * 1024 + rng() % (4 * 1024);
+    case think_patrol:  return 24 * 1024 + rng() % (16 * 1024);
+    default:            return 900 * 1024;
+    }
+}
+
+// Spawn count thinks, resume them all once, report what is reserved and resident while they are parked and
+// tear them down again, generations times over. stack_for( kind ) hands out the allocator for a kind,
+// reserved() the address space the live stacks hold, trim() empties the pools so every generation starts
+// from scratch.
+template< typename StackFor, typename Reserved, typename Trim >
+void RunGenerations( const char * name, StackFor stack_for, Reserved reserved, Trim trim, int count, int generations ) {
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( count );
+    std::minstd_rand rng;
+
+    for ( int gen = 0; gen < generations; ++gen ) {
+        timer time;
+        time.start();
+        for ( int i = 0; i < count; ++i ) {
+            const think_kind kind = KindOf( i );
+            const DWORD depth = DepthOf( kind, rng );
+            thinks.emplace_back( stack_for( kind ),
+            [depth]( think_co::pull_type& c ) {
+                StackConsume( depth );
+                StackShrink();
+                c();
+            } );
+        }
+        for ( auto & think : thinks ) {
+            think();
+        }
+        const double elapsed = time.stop();
+        std::cout << name << " generation " << gen << ": " << elapsed << " seconds, reserved "
+                  << std::fixed << std::setprecision( 2 ) << (double)reserved() / (1024 * 1024) << "MiB, resident "
+                  << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB" << std::defaultfloat << std::endl;
+        thinks.clear();
+        trim();
+    }
+}
+
+int main( int argc, char ** argv ) {
+    int count = argc > 1 ? std::atoi( argv[1] ) : 10'000;
+    int generations = argc > 2 ? std::atoi( argv[2] ) : 4;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    {
+        stack_pool_t pool{ stack_size, stack_pool_t::clock_type::duration::zero() };
+        RunGenerations( "1MiB pool:  ",
+            [&]( think_kind ) { return pooled_fixedsize_stack{ pool }; },
+            [&] { return count * stack_size; },
+            [&] { pool.trim(); },
+            count, generations );
+    }
+
+    size_class_pools_t pools{ { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 }, 64, stack_pool_t::clock_type::duration::zero() };
+    stack_type_t * types[] = { &pools.add_type( "Think" ), &pools.add_type( "Patrol" ), &pools.add_type( "Pathfind" ) };
+    RunGenerations( "size class: ",
+        [&]( think_kind kind ) { return size_class_stack{ pools, *types[kind] }; },
+        [&] {
+            std::size_t bytes = 0;
+            for ( std::size_t i = 0; i < pools.num_classes(); ++i ) {
+                auto stats = pools.class_stats( i );
+                bytes += stats.live * stats.stack_size;
+            }
+            return bytes;
+        },
+        [&] { pools.trim(); },
+        count, generations );
+
+    for ( auto & type : pools.types() ) {
+        std::cout << type.name << ": " << pools.class_stats( type.size_class ).stack_size / 1024 << "KiB class, "
+                  << type.samples << " samples, max depth " << type.max_depth / 1024 << "KiB, "
+                  << type.near_misses << " near misses, " << type.promotions << " promotions" << std::endl;
+    }
+    return 0;
+}
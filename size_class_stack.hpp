@@ -0,0 +1,193 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "pooled_stack.hpp"
+#include "stack_profile.hpp"
+
+// One kind of coroutine, every think of an entity type for example, and the size class its stacks come from.
+struct stack_type_t {
+    const char *    name;
+    std::size_t     size_class = 0;     // index into the classes of the size_class_pools_t it was added to
+    std::uint32_t   measuring = 0;      // stacks handed out to be measured
+    std::uint32_t   samples = 0;        // stacks whose depth was measured
+    std::size_t     max_depth = 0;      // deepest of them, in bytes
+    std::uint32_t   near_misses = 0;    // measured stacks that came close to their guard
+    std::uint32_t   promotions = 0;     // moves to the next bigger class after a near miss
+};
+
+struct size_class_stats {
+    std::size_t      stack_size = 0;
+    std::size_t      live = 0;          // stacks handed out and not back yet
+    stack_pool_stats pool;
+};
+
+// Stack pools of several sizes, 16 KiB, 64 KiB, 256 KiB and 1 MiB by default, with every coroutine type
+// getting its stacks from the smallest class its observed depth fits in.
+//
+// A new type starts in the biggest class and has its first learn_samples stacks measured, the whole usable
+// part is painted so even StackConsume's zero writes show up. The ones handed out while those are still running
+// come from the biggest class unmeasured, bar the usual samples. From then on it gets the smallest class whose
+// usable size has a quarter left over above the deepest of them, and one stack in sample_every is still
+// measured. A measured stack that went deeper than seven eighths of its usable size is a near miss and moves
+// the type up one class for every stack allocated after it. A stack that overflows its class without being
+// measured still hits the guard page, sampling only makes that less likely over time.
+//
+// Not thread safe, use one per thread like stack_pool_t.
+class size_class_pools_t {
+public:
+    typedef boost::context::stack_context stack_context;
+
+    static constexpr std::uint32_t learn_samples = 32;
+
+    // bytes at the top of every stack that are not stack, sctx.sp is the reservation top on Windows
+#ifdef _WIN32
+    static constexpr std::size_t header_size = 0;
+#else
+    static constexpr std::size_t header_size = stack_header_size;
+#endif
+
+    explicit size_class_pools_t( std::vector< std::size_t > class_sizes = { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 },
+                                 std::uint32_t sample_every = 64,
+                                 stack_pool_t::clock_type::duration decay = std::chrono::seconds( 1 ) ) :
+        profiler_( sample_every ) {
+        BOOST_ASSERT( !class_sizes.empty() );
+        for ( std::size_t size : class_sizes ) {
+            BOOST_ASSERT_MSG( classes_.empty() || classes_.back().size < size, "size classes must be ascending" );
+            classes_.push_back( size_class{ size, std::make_unique< stack_pool_t >( size, decay ), 0 } );
+        }
+    }
+
+    size_class_pools_t( const size_class_pools_t & ) = delete;
+    size_class_pools_t & operator=( const size_class_pools_t & ) = delete;
+
+    // The returned type stays valid for the life of the pools.
+    stack_type_t & add_type( const char * name ) {
+        types_.push_back( stack_type_t{ name, classes_.size() - 1 } );
+        return types_.back();
+    }
+
+    stack_context allocate( stack_type_t & type ) {
+        size_class & c = classes_[type.size_class];
+        stack_context sctx = c.pool->allocate();
+        ++c.live;
+        if ( type.measuring < learn_samples || profiler_.should_sample() ) {
+            ++type.measuring;
+            const auto page_size = boost::context::stack_traits::page_size();
+            // everything above the guard page
+            profiler_.track( sctx, type.name, static_cast< PBYTE >(sctx.sp) - sctx.size + page_size );
+        }
+        return sctx;
+    }
+
+    void deallocate( stack_type_t & type, stack_context & sctx ) {
+        size_class & c = class_of( sctx );
+        if ( std::optional< std::size_t > depth = profiler_.end( sctx ) ) {
+            note( type, c, *depth );
+            // hand back what was only painted, the pool should keep what the coroutine really used
+            StackTrim( sctx, *depth + header_size );
+        }
+        --c.live;
+        c.pool->deallocate( sctx );
+    }
+
+    // Release pooled stacks of every class that have been idle for longer than the decay.
+    void trim( stack_pool_t::clock_type::time_point now = stack_pool_t::clock_type::now() ) {
+        for ( auto & c : classes_ ) {
+            c.pool->trim( now );
+        }
+    }
+
+    std::size_t num_classes() const { return classes_.size(); }
+
+    size_class_stats class_stats( std::size_t index ) const {
+        const size_class & c = classes_[index];
+        return size_class_stats{ c.size, c.live, c.pool->stats() };
+    }
+
+    const std::deque< stack_type_t > & types() const { return types_; }
+    const stack_profiler_t & profiler() const { return profiler_; }
+
+private:
+    struct size_class {
+        std::size_t                     size;
+        std::unique_ptr< stack_pool_t > pool;
+        std::size_t                     live;
+    };
+
+    // usable bytes of a stack of the given class, what is left once guard page and header are taken off
+    static std::size_t usable_size( std::size_t size ) {
+        return size - boost::context::stack_traits::page_size() - header_size;
+    }
+
+    // the class a stack came from, the type might have moved on since
+    size_class & class_of( const stack_context & sctx ) {
+        for ( auto & c : classes_ ) {
+            if ( sctx.size <= c.size ) {
+                return c;
+            }
+        }
+        BOOST_ASSERT_MSG( false, "stack does not belong to any class" );
+        return classes_.back();
+    }
+
+    void note( stack_type_t & type, const size_class & c, std::size_t depth ) {
+        ++type.samples;
+        if ( type.max_depth < depth ) {
+            type.max_depth = depth;
+        }
+        if ( depth > usable_size( c.size ) / 8 * 7 ) {
+            ++type.near_misses;
+            // only if the type has not moved up since this stack was handed out
+            if ( c.size == classes_[type.size_class].size && type.size_class + 1 < classes_.size() ) {
+                ++type.size_class;
+                ++type.promotions;
+            }
+            return;
+        }
+        if ( type.samples == learn_samples ) {
+            std::size_t index = 0;
+            while ( index + 1 < classes_.size() && type.max_depth > usable_size( classes_[index].size ) / 4 * 3 ) {
+                ++index;
+            }
+            type.size_class = index;
+        }
+    }
+
+    stack_profiler_t                profiler_;
+    std::vector< size_class >       classes_;
+    std::deque< stack_type_t >      types_;
+};
+
+// StackAllocator handle onto a size_class_pools_t for one coroutine type, cheap to copy into every coroutine.
+class size_class_stack {
+private:
+    size_class_pools_t *    pools_;
+    stack_type_t *          type_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    size_class_stack( size_class_pools_t & pools, stack_type_t & type ) BOOST_NOEXCEPT_OR_NOTHROW :
+        pools_( &pools ), type_( &type ) {
+    }
+
+    stack_context allocate() {
+        return pools_->allocate( *type_ );
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        pools_->deallocate( *type_, sctx );
+    }
+};
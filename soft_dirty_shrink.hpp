@@ -0,0 +1,300 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "reserved_stack.hpp"
+
+#ifndef PAGEMAP_SCAN
+// Linux 6.7, not in older uapi headers
+struct page_region {
+    std::uint64_t start;
+    std::uint64_t end;
+    std::uint64_t categories;
+};
+
+struct pm_scan_arg {
+    std::uint64_t size;
+    std::uint64_t flags;
+    std::uint64_t start;
+    std::uint64_t end;
+    std::uint64_t walk_end;
+    std::uint64_t vec;
+    std::uint64_t vec_len;
+    std::uint64_t max_pages;
+    std::uint64_t category_inverted;
+    std::uint64_t category_mask;
+    std::uint64_t category_anyof_mask;
+    std::uint64_t return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR( 'f', 16, struct pm_scan_arg )
+#define PAGE_IS_PRESENT     (1 << 3)
+#define PAGE_IS_SWAPPED     (1 << 4)
+#define PAGE_IS_SOFT_DIRTY  (1 << 7)
+#endif
+
+struct soft_dirty_stats {
+    std::uint64_t stacks = 0;           // parked stacks looked at
+    std::uint64_t skipped = 0;          // of those, not parked again since the last pass
+    std::uint64_t pagemap_reads = 0;    // PAGEMAP_SCAN ioctls or preads on /proc/self/pagemap
+    std::uint64_t pagemap_pages = 0;    // pages those reported on
+    std::uint64_t madvise_calls = 0;
+    std::uint64_t released_pages = 0;   // pages handed back, resident or not
+};
+
+// Shrink passes over parked stacks that only release what was written since the previous pass. Everything
+// below a stack's releasable boundary (the page under the one its coroutine parked in, see StackPark) was
+// released by the previous pass, so the only pages there worth an madvise are the ones that became dirty
+// since: present or swapped, and soft-dirty since the clear_refs at the end of the previous pass. The part
+// between the old and the new boundary, when a coroutine parked shallower than last time, is released
+// outright.
+//
+// Looking at a page table costs about as much as zapping an empty one, so stacks whose park count did not
+// move since the last pass are skipped before the kernel is asked anything, and only the ones that ran are
+// scanned. With PAGEMAP_SCAN (Linux 6.7) adjacent ones are scanned together and the kernel only returns the
+// runs that match; older kernels read the raw entries, batch_pages at a time. Writing 4 to clear_refs
+// resets the bits for the whole process and write protects every page in it, the next write to any of them
+// takes a minor fault. Kernels built without CONFIG_MEM_SOFT_DIRTY accept the write but never set the bit;
+// that is detected up front and the scan then goes by presence alone, which releases the same pages except
+// for ones that were only ever read.
+//
+// Only call shrink while none of the given stacks is running, and bracket every resume of their coroutines
+// with StackBeginResume and StackEndResume: one that suspends without parking again has its frames anywhere
+// below the old park point and is left alone until it parks.
+class soft_dirty_shrinker_t {
+public:
+    static constexpr std::uint64_t pm_present = std::uint64_t( 1 ) << 63;
+    static constexpr std::uint64_t pm_swapped = std::uint64_t( 1 ) << 62;
+    static constexpr std::uint64_t pm_soft_dirty = std::uint64_t( 1 ) << 55;
+
+    explicit soft_dirty_shrinker_t( bool use_soft_dirty = true, std::size_t batch_pages = 64 * 1024 ) :
+        buffer_( batch_pages ? batch_pages : 1 ) {
+        pagemap_ = ::open( "/proc/self/pagemap", O_RDONLY | O_CLOEXEC );
+        if ( pagemap_ < 0 ) {
+            throw std::system_error( errno, std::system_category(), "/proc/self/pagemap" );
+        }
+        soft_dirty_ = use_soft_dirty && probe_soft_dirty();
+    }
+
+    ~soft_dirty_shrinker_t() {
+        ::close( pagemap_ );
+    }
+
+    soft_dirty_shrinker_t( const soft_dirty_shrinker_t & ) = delete;
+    soft_dirty_shrinker_t & operator=( const soft_dirty_shrinker_t & ) = delete;
+
+    // Whether passes look at the soft-dirty bit, or at presence only.
+    bool soft_dirty() const { return soft_dirty_; }
+
+    // One incremental pass, stacks that never parked are skipped. Passing the headers in address order
+    // (stack_arena_t::for_each_stack) saves a sort.
+    soft_dirty_stats shrink( stack_header * const * hdrs, std::size_t count ) {
+        soft_dirty_stats stats;
+
+        ranges_.clear();
+        for ( std::size_t i = 0; i < count; ++i ) {
+            stack_header * hdr = hdrs[i];
+            PBYTE pEnd = releasable_end( hdr );
+            if ( !pEnd ) {
+                continue;
+            }
+            ++stats.stacks;
+            const std::uint32_t parks = hdr->parks.load( std::memory_order_acquire );
+            if ( hdr->released_end && parks == hdr->shrunk_parks ) {
+                ++stats.skipped;
+                continue;
+            }
+            hdr->shrunk_parks = parks;
+
+            PBYTE pReleased = hdr->released_end ? hdr->released_end : hdr->usable();
+            if ( pReleased < pEnd ) {
+                release( pReleased, pEnd, stats );
+            }
+            PBYTE pScanEnd = std::min( pReleased, pEnd );
+            if ( hdr->usable() < pScanEnd ) {
+                ranges_.push_back( { hdr->usable(), pScanEnd } );
+            }
+            hdr->released_end = pEnd;
+        }
+
+        if ( !std::is_sorted( ranges_.begin(), ranges_.end(), range_less ) ) {
+            std::sort( ranges_.begin(), ranges_.end(), range_less );
+        }
+        if ( !ranges_.empty() && !(use_scan_ && scan_ranges( stats )) ) {
+            for ( const range & r : ranges_ ) {
+                read_range( r, stats );
+            }
+        }
+
+        if ( soft_dirty_ ) {
+            clear_soft_dirty();
+        }
+        return stats;
+    }
+
+    // The non-incremental reference: release everything below every parked stack's boundary. Same contract as
+    // shrink.
+    static soft_dirty_stats shrink_all( stack_header * const * hdrs, std::size_t count ) {
+        soft_dirty_stats stats;
+        for ( std::size_t i = 0; i < count; ++i ) {
+            PBYTE pEnd = releasable_end( hdrs[i] );
+            if ( !pEnd ) {
+                continue;
+            }
+            ++stats.stacks;
+            if ( hdrs[i]->usable() < pEnd ) {
+                release( hdrs[i]->usable(), pEnd, stats );
+            }
+            hdrs[i]->released_end = pEnd;
+        }
+        return stats;
+    }
+
+private:
+    struct range {
+        PBYTE begin;
+        PBYTE end;
+    };
+
+    static bool range_less( const range & a, const range & b ) { return a.begin < b.begin; }
+
+    // keep the page the coroutine parked in and one below it for the switch, like StackShrink
+    static PBYTE releasable_end( const stack_header * hdr ) {
+        PBYTE sp = hdr->parked_sp.load( std::memory_order_acquire );
+        if ( !sp ) {
+            return nullptr;
+        }
+        const auto page_size = boost::context::stack_traits::page_size();
+        return std::max( hdr->usable(), sp - ((uintptr_t)sp & (page_size - 1)) - page_size );
+    }
+
+    static void release( PBYTE pBegin, PBYTE pEnd, soft_dirty_stats & stats ) {
+        BOOST_VERIFY( 0 == ::madvise( pBegin, pEnd - pBegin, MADV_DONTNEED ) );
+        ++stats.madvise_calls;
+        stats.released_pages += (pEnd - pBegin) / boost::context::stack_traits::page_size();
+    }
+
+    // Release the parts of ranges_ that PAGEMAP_SCAN reports as dirty. Ranges that are only a few pages
+    // apart, the kept tops of neighbouring stacks, are walked as one span. False if the kernel does not
+    // know the ioctl.
+    bool scan_ranges( soft_dirty_stats & stats ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        const std::size_t max_gap = 16 * page_size;
+        page_region regions[256];
+
+        std::size_t next = 0;   // first range that can still overlap a returned region
+        for ( std::size_t first = 0; first < ranges_.size(); ) {
+            std::size_t last = first;
+            while ( last + 1 < ranges_.size() && (std::size_t)(ranges_[last + 1].begin - ranges_[last].end) <= max_gap ) {
+                ++last;
+            }
+
+            pm_scan_arg arg = {};
+            arg.size = sizeof( arg );
+            arg.start = (std::uintptr_t)ranges_[first].begin;
+            arg.end = (std::uintptr_t)ranges_[last].end;
+            arg.vec = (std::uintptr_t)regions;
+            arg.vec_len = sizeof( regions ) / sizeof( regions[0] );
+            arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+            arg.category_mask = soft_dirty_ ? PAGE_IS_SOFT_DIRTY : 0;
+            arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED | PAGE_IS_SOFT_DIRTY;
+            while ( arg.start < arg.end ) {
+                const int found = ::ioctl( pagemap_, PAGEMAP_SCAN, &arg );
+                if ( found < 0 ) {
+                    BOOST_ASSERT_MSG( stats.pagemap_reads == 0, "PAGEMAP_SCAN failed midway" );
+                    use_scan_ = false;
+                    return false;
+                }
+                ++stats.pagemap_reads;
+                for ( int i = 0; i < found; ++i ) {
+                    PBYTE pBegin = (PBYTE)regions[i].start;
+                    PBYTE pEnd = (PBYTE)regions[i].end;
+                    stats.pagemap_pages += (pEnd - pBegin) / page_size;
+                    while ( next <= last && ranges_[next].end <= pBegin ) {
+                        ++next;
+                    }
+                    for ( std::size_t r = next; r <= last && ranges_[r].begin < pEnd; ++r ) {
+                        release( std::max( pBegin, ranges_[r].begin ), std::min( pEnd, ranges_[r].end ), stats );
+                    }
+                }
+                arg.start = arg.walk_end;
+            }
+            first = last + 1;
+        }
+        return true;
+    }
+
+    // Without PAGEMAP_SCAN: read the raw entries of one range and release its dirty runs.
+    void read_range( const range & r, soft_dirty_stats & stats ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        PBYTE pRun = nullptr;
+        for ( PBYTE pPos = r.begin; pPos < r.end; ) {
+            const std::size_t pages = std::min< std::size_t >( buffer_.size(), (r.end - pPos) / page_size );
+            const off_t offset = (off_t)((uintptr_t)pPos / page_size * sizeof( std::uint64_t ));
+            const ssize_t bytes = ::pread( pagemap_, buffer_.data(), pages * sizeof( std::uint64_t ), offset );
+            const std::size_t got = bytes > 0 ? (std::size_t)bytes / sizeof( std::uint64_t ) : 0;
+            // whatever could not be read counts as dirty, releasing it is always safe
+            std::fill( buffer_.begin() + got, buffer_.begin() + pages, pm_present | pm_soft_dirty );
+            ++stats.pagemap_reads;
+            stats.pagemap_pages += got;
+
+            for ( std::size_t i = 0; i < pages; ++i, pPos += page_size ) {
+                const std::uint64_t entry = buffer_[i];
+                const bool dirty = (entry & (pm_present | pm_swapped)) && (!soft_dirty_ || (entry & pm_soft_dirty));
+                if ( dirty ) {
+                    if ( !pRun ) pRun = pPos;
+                } else if ( pRun ) {
+                    release( pRun, pPos, stats );
+                    pRun = nullptr;
+                }
+            }
+        }
+        if ( pRun ) {
+            release( pRun, r.end, stats );
+        }
+    }
+
+    static void clear_soft_dirty() {
+        const int fd = ::open( "/proc/self/clear_refs", O_WRONLY | O_CLOEXEC );
+        if ( fd >= 0 ) {
+            BOOST_VERIFY( 1 == ::write( fd, "4", 1 ) );
+            ::close( fd );
+        }
+    }
+
+    // Write a fresh page after clearing and see whether the kernel flags it.
+    bool probe_soft_dirty() {
+        const auto page_size = boost::context::stack_traits::page_size();
+        void * vp = ::mmap( nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( vp == MAP_FAILED ) throw std::bad_alloc();
+        volatile BYTE * p = static_cast< BYTE * >(vp);
+        p[0] = 1;
+        clear_soft_dirty();
+        p[0] = 2;
+        std::uint64_t entry = 0;
+        const off_t offset = (off_t)((uintptr_t)vp / page_size * sizeof( entry ));
+        const bool flagged = sizeof( entry ) == ::pread( pagemap_, &entry, sizeof( entry ), offset ) && (entry & pm_soft_dirty);
+        ::munmap( vp, page_size );
+        return flagged;
+    }
+
+    int                             pagemap_ = -1;
+    bool                            soft_dirty_ = false;
+    bool                            use_scan_ = true;
+    std::vector< std::uint64_t >    buffer_;
+    std::vector< range >            ranges_;
+};
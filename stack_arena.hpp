@@ -0,0 +1,178 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "reserved_stack.hpp"
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+// All stacks in one contiguous reservation, carved into power of two sized slots that are handed out by
+// index from a LIFO free-list. The whole slab is a single read/write MAP_NORESERVE mapping, so it costs one
+// VMA no matter how many stacks it holds, and the guard page of each slot is installed with
+// MADV_GUARD_INSTALL, which does not split the mapping. On kernels before 6.13 the guards fall back to
+// PROT_NONE pages, that costs two VMAs per stack again and count is then bounded by vm.max_map_count.
+//
+// Every slot's top is aligned to the slot size, so find_stack_header and with it StackShrink, StackCommit and
+// QueryStackRegions work on arena stacks unchanged. Released slots keep their guard, the pages above it go
+// back to the kernel. Destroying the arena releases the slab with one munmap; after begin_teardown() the
+// coroutines still alive can be destroyed without touching their pages at all. Not thread safe.
+class stack_arena_t {
+public:
+    // huge_pages applies to the whole slab. hugetlb is not an option for it, released slots have to give their
+    // pages back, and gets transparent huge pages instead.
+    stack_arena_t( std::size_t num_slots, std::size_t stack_size, stack_huge_pages huge_pages = stack_huge_pages::never ) :
+        num_slots_( num_slots ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(stack_size) / page_size )) );
+        BOOST_ASSERT_MSG( 3 <= pages, "the guard and the initial commit must fit into stack" );
+        size_ = pages * page_size;
+        slot_size_ = stack_alignment( size_ );
+
+        // over-reserve by one slot so the first slot can start on a slot_size boundary
+        const std::size_t span = (num_slots_ + 1) * slot_size_;
+        void * vp = ::mmap( nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if ( vp == MAP_FAILED ) throw std::bad_alloc();
+        PBYTE pBegin = static_cast< PBYTE >(vp);
+        slab_ = (PBYTE)(((uintptr_t)pBegin + slot_size_ - 1) & ~(uintptr_t)(slot_size_ - 1));
+        if ( slab_ > pBegin ) {
+            ::munmap( pBegin, slab_ - pBegin );
+        }
+        PBYTE pEnd = slab_ + num_slots_ * slot_size_;
+        if ( pBegin + span > pEnd ) {
+            ::munmap( pEnd, pBegin + span - pEnd );
+        }
+        AdviseHugePages( slab_, num_slots_ * slot_size_,
+                         huge_pages == stack_huge_pages::hugetlb ? stack_huge_pages::transparent : huge_pages );
+
+        free_.reserve( num_slots_ );
+    }
+
+    ~stack_arena_t() {
+        ::munmap( slab_, num_slots_ * slot_size_ );
+    }
+
+    stack_arena_t( const stack_arena_t & ) = delete;
+    stack_arena_t & operator=( const stack_arena_t & ) = delete;
+
+    boost::context::stack_context allocate() {
+        std::size_t index;
+        if ( !free_.empty() ) {
+            index = free_.back();
+            free_.pop_back();
+        } else if ( fresh_ < num_slots_ ) {
+            index = fresh_++;
+            install_guard( slot_base( index ) );
+        } else {
+            throw std::bad_alloc();
+        }
+
+        const auto one_page_size = boost::context::stack_traits::page_size();
+        PBYTE vp = slot_base( index );
+
+        // needs at least 2 pages to fully construct the coroutine and switch to it
+        const auto init_commit_size = one_page_size + one_page_size;
+        CommitPages( vp + size_ - init_commit_size, init_commit_size );
+        stack_header * hdr = InitStackHeader( vp, size_, one_page_size );
+        ++in_use_;
+
+        boost::context::stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( boost::context::stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        BOOST_ASSERT( hdr->self == hdr );
+        PBYTE top = hdr->top();
+        const std::size_t index = (top - slab_) / slot_size_ - 1;
+        BOOST_ASSERT( index < fresh_ );
+        --in_use_;
+        if ( tearing_down_ ) {
+            return;
+        }
+        // the header goes with the pages, a stale one must not be found in a free slot
+        BOOST_VERIFY( 0 == ::madvise( hdr->usable(), top - hdr->usable(), MADV_DONTNEED ) );
+        free_.push_back( (std::uint32_t)index );
+    }
+
+    // Call fn( stack_header & ) for every stack currently handed out, in address order. Released slots have
+    // had their header dropped with the rest of their pages.
+    template< typename Fn >
+    void for_each_stack( Fn && fn ) const {
+        for ( std::size_t index = 0; index < fresh_; ++index ) {
+            if ( stack_header * hdr = stack_header_at( slab_ + (index + 1) * slot_size_ ) ) {
+                fn( *hdr );
+            }
+        }
+    }
+
+    // From here on released slots are neither cleaned nor reused, the munmap in the destructor drops them
+    // all at once.
+    void begin_teardown() { tearing_down_ = true; }
+
+    bool guard_markers() const { return guard_markers_; }
+    std::size_t in_use() const { return in_use_; }
+    std::size_t num_slots() const { return num_slots_; }
+    std::size_t get_stack_size() const { return size_; }
+
+private:
+    // the stack sits at the top of its slot, anything between the slot start and its guard is never touched
+    PBYTE slot_base( std::size_t index ) const {
+        return slab_ + (index + 1) * slot_size_ - size_;
+    }
+
+    void install_guard( PBYTE pGuard ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        if ( guard_markers_ && 0 == ::madvise( pGuard, page_size, MADV_GUARD_INSTALL ) ) {
+            return;
+        }
+        guard_markers_ = false;
+        BOOST_VERIFY( 0 == ::mprotect( pGuard, page_size, PROT_NONE ) );
+    }
+
+    PBYTE                           slab_;
+    std::size_t                     num_slots_;
+    std::size_t                     size_;
+    std::size_t                     slot_size_;
+    std::size_t                     fresh_ = 0;     // slots below this one have been handed out before
+    std::size_t                     in_use_ = 0;
+    std::vector< std::uint32_t >    free_;
+    bool                            guard_markers_ = true;
+    bool                            tearing_down_ = false;
+};
+
+// StackAllocator handle onto a stack_arena_t.
+class arena_fixedsize_stack {
+private:
+    stack_arena_t * arena_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    arena_fixedsize_stack( stack_arena_t & arena ) BOOST_NOEXCEPT_OR_NOTHROW :
+        arena_( &arena ) {
+    }
+
+    stack_context allocate() {
+        return arena_->allocate();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        arena_->deallocate( sctx );
+    }
+};
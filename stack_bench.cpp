@@ -0,0 +1,414 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <cstdlib>
+#include <iterator>
+#include <optional>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_metrics.hpp"
+#include "shared_stack.hpp"
+#include "awe_stack.hpp"
+#ifndef _WIN32
+#include "hot_stack.hpp"
+#include "stack_arena.hpp"
+#include "uffd_stack.hpp"
+#include "segv_stack.hpp"
+#endif
+
+// Runs every stack strategy through the same grid of entity count, reserve size, consumed depth and resumes
+// per entity, and writes one JSON record per run. Each entity consumes the depth on every resume and then
+// parks; steady RSS is taken with all of them parked after the last round.
+//
+//   StackBench [--strategy reserved,awe,...] [--count 1000,10000] [--reserve 1M] [--depth 900K]
+//              [--resumes 2] [--release dontneed,free,cold,pageout] [--out results.json]
+//              [--samples memory.csv] [--sample-ms 100]
+//
+// --release picks how StackShrink hands the pages back, for the strategies that shrink after every resume;
+// the others run once per grid point. lazy_free_rss is the part of steady RSS the kernel may still take back
+// on its own (MADV_FREE), pageout only lowers RSS when there is swap to write the pages to.
+//
+// --samples writes a memory time series of every run as CSV, a sample every --sample-ms, for plotting memory
+// against the number of entities created so far: RSS, PSS and anonymous bytes, faults, and the pages the
+// coroutine stacks have resident.
+//
+// Counts beyond ~30000 run into vm.max_map_count with one reservation per entity, except for arena.
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+// the stacks of the run in progress and the entities it created so far, for --samples
+stack_metrics_t bench_metrics;
+
+struct bench_params {
+    std::string     strategy;
+    int             count;
+    std::size_t     reserve;
+    std::size_t     depth;
+    int             resumes;
+    stack_release   release;
+};
+
+struct bench_result {
+    double          setup_s = 0;
+    double          wall_s = 0;
+    process_usage   before;         // before the entities are created
+    process_usage   parked;         // after the last round, everything parked
+    std::size_t     lazy_free_bytes = 0;
+    std::uint64_t   setup_faults = 0;
+    std::uint64_t   resume_faults = 0;
+    std::string     error;
+};
+
+// Brackets the two phases of a run.
+class bench_probe {
+public:
+    bench_probe() {
+        ResetPeakResident();
+        r_.before = QueryProcessUsage();
+        time_.start();
+    }
+
+    void setup_done() {
+        r_.setup_s = time_.stop();
+        r_.setup_faults = QueryProcessUsage().minor_faults - r_.before.minor_faults;
+        time_.start();
+    }
+
+    bench_result resumes_done() {
+        r_.wall_s = time_.stop();
+        r_.parked = QueryProcessUsage();
+        r_.lazy_free_bytes = QueryLazyFreeBytes();
+        r_.resume_faults = r_.parked.minor_faults - r_.before.minor_faults - r_.setup_faults;
+        return r_;
+    }
+
+private:
+    timer           time_;
+    bench_result    r_;
+};
+
+// The thread's own stack, one plain call per resume, nothing is parked.
+bench_result RunBaseline( const bench_params & p ) {
+    bench_probe probe;
+    probe.setup_done();
+    for ( int n = 0; n < p.resumes; ++n ) {
+        for ( int i = 0; i < p.count; ++i ) {
+            StackConsume( (DWORD)p.depth );
+        }
+    }
+    return probe.resumes_done();
+}
+
+// Resume every coroutine p.resumes times, body runs before each suspend. The probe is taken while they
+// are all alive, the allocator they came from has to outlive them.
+template< typename StackAllocator, typename Body >
+bench_result RunCoroutines( const bench_params & p, StackAllocator & stack, Body body ) {
+    bench_probe probe;
+    metered_stack< StackAllocator > metered{ bench_metrics, stack };
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( p.count );
+    for ( int i = 0; i < p.count; ++i ) {
+        thinks.emplace_back( metered,
+        [&]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                body();
+                c();
+            }
+        } );
+        bench_metrics.set_entities( i + 1 );
+    }
+    probe.setup_done();
+    for ( int n = 0; n < p.resumes; ++n ) {
+        for ( auto & think : thinks ) {
+            think();
+        }
+    }
+    return probe.resumes_done();
+}
+
+bench_result RunReserved( const bench_params & p ) {
+    reserved_fixedsize_stack stack{ p.reserve };
+    return RunCoroutines( p, stack, [&] {
+        StackConsume( (DWORD)p.depth );
+        StackShrink( p.release );
+    } );
+}
+
+bench_result RunShared( const bench_params & p ) {
+    shared_stack_t stack{ p.reserve };
+    bench_probe probe;
+    std::vector<std::unique_ptr<copy_coroutine>> thinks;
+    thinks.reserve( p.count );
+    for ( int i = 0; i < p.count; ++i ) {
+        thinks.emplace_back( new copy_coroutine( stack,
+        [&]( copy_coroutine& c ) {
+            for ( ;; ) {
+                StackConsume( (DWORD)p.depth );
+                c.yield();
+            }
+        } ) );
+        bench_metrics.set_entities( i + 1 );
+    }
+    probe.setup_done();
+    for ( int n = 0; n < p.resumes; ++n ) {
+        for ( auto & think : thinks ) {
+            (*think)();
+        }
+    }
+    return probe.resumes_done();
+}
+
+bench_result RunAwe( const bench_params & p ) {
+    awe_stack_pool_t stack_pool( p.count, p.reserve );
+    awe_fixedsize_stack stack{ stack_pool };
+    return RunCoroutines( p, stack, [&] {
+        stack_pool.map_stack();
+        StackConsume( (DWORD)p.depth );
+        stack_pool.unmap_stack();
+    } );
+}
+
+#ifndef _WIN32
+bench_result RunHot( const bench_params & p ) {
+    hot_stack_region_t hot_region{ p.reserve };
+    reserved_fixedsize_stack stack{ p.reserve };
+    return RunCoroutines( p, stack, [&] {
+        hot_region.map_stack();
+        StackConsume( (DWORD)p.depth );
+        hot_region.unmap_stack();
+    } );
+}
+
+bench_result RunArena( const bench_params & p ) {
+    stack_arena_t arena{ (std::size_t)p.count, p.reserve };
+    arena_fixedsize_stack stack{ arena };
+    return RunCoroutines( p, stack, [&] {
+        StackConsume( (DWORD)p.depth );
+        StackShrink( p.release );
+    } );
+}
+
+bench_result RunUffd( const bench_params & p ) {
+    uffd_stack_space_t space{ p.reserve };
+    uffd_fixedsize_stack stack{ space };
+    return RunCoroutines( p, stack, [&] {
+        StackConsume( (DWORD)p.depth );
+        StackShrink( p.release );
+    } );
+}
+
+bench_result RunSegv( const bench_params & p ) {
+    segv_stack_space_t space{ p.reserve };
+    segv_fixedsize_stack stack{ space };
+    return RunCoroutines( p, stack, [&] {
+        StackConsume( (DWORD)p.depth );
+        StackShrink( p.release );
+    } );
+}
+#endif
+
+struct strategy_t {
+    const char *    name;
+    bench_result    (*run)( const bench_params & );
+    bool            uses_reserve;
+    bool            uses_release;
+};
+
+const strategy_t strategies[] = {
+    { "baseline", &RunBaseline, false, false },
+    { "reserved", &RunReserved, true, true },
+    { "shared", &RunShared, true, false },
+    { "awe", &RunAwe, true, false },
+#ifndef _WIN32
+    { "hot", &RunHot, true, false },
+    { "arena", &RunArena, true, true },
+    { "uffd", &RunUffd, true, true },
+    { "segv", &RunSegv, true, true },
+#endif
+};
+
+const char * const release_names[] = { "dontneed", "free", "cold", "pageout" };
+
+stack_release ParseRelease( const std::string & s ) {
+    for ( std::size_t i = 0; i < std::size( release_names ); ++i ) {
+        if ( s == release_names[i] ) return (stack_release)i;
+    }
+    throw std::invalid_argument( "bad release: " + s );
+}
+
+// "900K", "1M", "4096"
+std::size_t ParseSize( const std::string & s ) {
+    std::size_t pos = 0;
+    std::size_t value = std::stoull( s, &pos );
+    if ( pos < s.size() ) {
+        switch ( s[pos] ) {
+        case 'k': case 'K': value <<= 10; break;
+        case 'm': case 'M': value <<= 20; break;
+        case 'g': case 'G': value <<= 30; break;
+        default: throw std::invalid_argument( "bad size: " + s );
+        }
+    }
+    return value;
+}
+
+std::vector< std::string > SplitList( const std::string & s ) {
+    std::vector< std::string > items;
+    std::istringstream in( s );
+    for ( std::string item; std::getline( in, item, ',' ); ) {
+        if ( !item.empty() ) items.push_back( item );
+    }
+    return items;
+}
+
+void WriteRecord( std::ostream & out, const bench_params & p, bool release, const bench_result & r ) {
+    const double resumes = (double)p.count * p.resumes;
+    out << "    { \"strategy\": \"" << p.strategy << "\""
+        << ", \"count\": " << p.count
+        << ", \"reserve\": " << p.reserve
+        << ", \"depth\": " << p.depth
+        << ", \"resumes\": " << p.resumes;
+    if ( release ) {
+        out << ", \"release\": \"" << release_names[(int)p.release] << "\"";
+    }
+    if ( !r.error.empty() ) {
+        out << ", \"error\": \"" << r.error << "\" }";
+        return;
+    }
+    out << ", \"setup_s\": " << r.setup_s
+        << ", \"wall_s\": " << r.wall_s
+        << ", \"ns_per_resume\": " << (resumes ? r.wall_s * 1e9 / resumes : 0.0)
+        << ", \"base_rss\": " << r.before.resident_bytes
+        << ", \"peak_rss\": " << r.parked.peak_resident_bytes
+        << ", \"steady_rss\": " << r.parked.resident_bytes
+        << ", \"lazy_free_rss\": " << r.lazy_free_bytes
+        << ", \"setup_minor_faults\": " << r.setup_faults
+        << ", \"minor_faults\": " << r.resume_faults
+        << ", \"minor_faults_per_resume\": " << (resumes ? r.resume_faults / resumes : 0.0)
+        << " }";
+}
+
+int main( int argc, char ** argv ) {
+    std::vector< std::string > names;
+    std::vector< int > counts{ 1000, 10000 };
+    std::vector< std::size_t > reserves{ 1 * 1024 * 1024 };
+    std::vector< std::size_t > depths{ 900 * 1024 };
+    std::vector< int > resumes{ 2 };
+    std::vector< stack_release > releases{ stack_release::dontneed };
+    std::string out_path;
+    std::string samples_path;
+    int sample_ms = 100;
+
+    for ( int i = 1; i + 1 < argc; i += 2 ) {
+        const std::string opt = argv[i];
+        const auto values = SplitList( argv[i + 1] );
+        if ( opt == "--strategy" ) {
+            names = values;
+        } else if ( opt == "--count" ) {
+            counts.clear();
+            for ( auto & v : values ) counts.push_back( std::atoi( v.c_str() ) );
+        } else if ( opt == "--reserve" ) {
+            reserves.clear();
+            for ( auto & v : values ) reserves.push_back( ParseSize( v ) );
+        } else if ( opt == "--depth" ) {
+            depths.clear();
+            for ( auto & v : values ) depths.push_back( ParseSize( v ) );
+        } else if ( opt == "--resumes" ) {
+            resumes.clear();
+            for ( auto & v : values ) resumes.push_back( std::atoi( v.c_str() ) );
+        } else if ( opt == "--release" ) {
+            releases.clear();
+            for ( auto & v : values ) releases.push_back( ParseRelease( v ) );
+        } else if ( opt == "--out" ) {
+            out_path = argv[i + 1];
+        } else if ( opt == "--samples" ) {
+            samples_path = argv[i + 1];
+        } else if ( opt == "--sample-ms" ) {
+            sample_ms = std::atoi( argv[i + 1] );
+        } else {
+            std::cerr << "unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+    if ( names.empty() ) {
+        for ( auto & s : strategies ) names.push_back( s.name );
+    }
+
+    std::ofstream file;
+    if ( !out_path.empty() ) {
+        file.open( out_path );
+    }
+    std::ostream & out = out_path.empty() ? std::cout : file;
+
+    std::ofstream samples;
+    if ( !samples_path.empty() ) {
+        samples.open( samples_path );
+        samples << "strategy,count,reserve,depth,resumes,release,";
+        WriteSampleHeader( samples );
+    }
+
+    out << "{\n  \"page_size\": " << boost::context::stack_traits::page_size() << ",\n  \"runs\": [\n";
+    bool first = true;
+    for ( auto & name : names ) {
+        const strategy_t * strategy = nullptr;
+        for ( auto & s : strategies ) {
+            if ( name == s.name ) strategy = &s;
+        }
+        if ( !strategy ) {
+            std::cerr << "unknown strategy " << name << std::endl;
+            return 1;
+        }
+        for ( int count : counts ) {
+            for ( std::size_t reserve : reserves ) {
+                for ( std::size_t depth : depths ) {
+                    for ( int n : resumes ) {
+                        for ( stack_release release : releases ) {
+                            // the release only makes a difference to the strategies that shrink
+                            if ( !strategy->uses_release && release != releases.front() ) {
+                                continue;
+                            }
+                            bench_params p{ name, count, reserve, depth, n, release };
+                            bench_result r;
+                            out << (first ? "" : ",\n") << std::flush;
+                            first = false;
+                            // leave room for the guard, the header and the frames on top of the consumed depth
+                            if ( strategy->uses_reserve && depth + 16 * 1024 > reserve ) {
+                                r.error = "depth does not fit into reserve";
+                            } else {
+                                std::cerr << name << " count=" << count << " reserve=" << reserve
+                                          << " depth=" << depth << " resumes=" << n;
+                                if ( strategy->uses_release ) {
+                                    std::cerr << " release=" << release_names[(int)release];
+                                }
+                                std::cerr << std::endl;
+                                bench_metrics.set_entities( 0 );
+                                std::optional< memory_sampler_t > sampler;
+                                if ( samples.is_open() ) {
+                                    sampler.emplace( bench_metrics, std::chrono::milliseconds( sample_ms ),
+                                    [&samples, &p, strategy]( const memory_sample & s ) {
+                                        samples << p.strategy << ',' << p.count << ',' << p.reserve << ',' << p.depth
+                                                << ',' << p.resumes << ','
+                                                << (strategy->uses_release ? release_names[(int)p.release] : "") << ',';
+                                        WriteSample( samples, s );
+                                    } );
+                                }
+                                try {
+                                    r = strategy->run( p );
+                                } catch ( const std::exception & e ) {
+                                    r.error = e.what();
+                                }
+                            }
+                            WriteRecord( out, p, strategy->uses_release, r );
+                        }
+                    }
+                }
+            }
+        }
+    }
+    out << "\n  ]\n}" << std::endl;
+    return 0;
+}
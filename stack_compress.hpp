@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "stack_header.hpp"
+
+// A small LZ77 codec for parked stack contents, in the spirit of LZ4: greedy matching through a hash table of
+// 4 byte sequences, no entropy coding, byte aligned output. Stacks are mostly zeroes, return addresses and
+// pointers into a few regions, which that handles well at memory speed.
+//
+// A block is a run of sequences. Each one starts with a token byte, the literal count in the high nibble and
+// the match length minus 4 in the low one, a nibble of 15 continuing in extra bytes that are added up until
+// one is below 255. The literals follow, then the match offset as 2 bytes little endian, then the extra match
+// length bytes. The last sequence has literals only and ends the block.
+
+// Worst case compressed size of size bytes.
+constexpr std::size_t StackCompressBound( std::size_t size ) {
+    return size + size / 255 + 16;
+}
+
+namespace stack_compress_detail {
+
+constexpr int hash_bits = 12;
+constexpr std::size_t min_match = 4;
+constexpr std::size_t max_offset = 65535;
+
+inline std::uint32_t Read32( const BYTE * p ) {
+    std::uint32_t v;
+    std::memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+inline BYTE * WriteLength( BYTE * op, std::size_t extra ) {
+    for ( ; extra >= 255; extra -= 255 ) {
+        *op++ = 255;
+    }
+    *op++ = (BYTE)extra;
+    return op;
+}
+
+inline BYTE * WriteSequence( BYTE * op, const BYTE * literals, std::size_t literal_count, std::size_t offset,
+                             std::size_t match_length ) {
+    BYTE * token = op++;
+    const std::size_t match_code = match_length ? match_length - min_match : 0;
+    *token = (BYTE)(((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if ( literal_count >= 15 ) {
+        op = WriteLength( op, literal_count - 15 );
+    }
+    if ( literal_count ) {
+        std::memcpy( op, literals, literal_count );
+        op += literal_count;
+    }
+    if ( match_length ) {
+        *op++ = (BYTE)offset;
+        *op++ = (BYTE)(offset >> 8);
+        if ( match_code >= 15 ) {
+            op = WriteLength( op, match_code - 15 );
+        }
+    }
+    return op;
+}
+
+// false if the length runs past end
+inline bool ReadLength( const BYTE *& ip, const BYTE * end, std::size_t & length ) {
+    BYTE b;
+    do {
+        if ( ip == end ) {
+            return false;
+        }
+        b = *ip++;
+        length += b;
+    } while ( b == 255 );
+    return true;
+}
+
+}
+
+// Compress size bytes from src into dst, which must hold StackCompressBound( size ) bytes. Returns the
+// compressed size.
+inline std::size_t StackCompress( const BYTE * src, std::size_t size, BYTE * dst ) {
+    using namespace stack_compress_detail;
+    std::uint32_t table[1 << hash_bits];
+    std::memset( table, 0, sizeof( table ) );
+
+    const BYTE * ip = src;
+    const BYTE * anchor = src;
+    const BYTE * const end = src + size;
+    BYTE * op = dst;
+    if ( size > min_match ) {
+        const BYTE * const match_limit = end - min_match;
+        while ( ip <= match_limit ) {
+            const std::uint32_t seq = Read32( ip );
+            const std::uint32_t h = (seq * 2654435761u) >> (32 - hash_bits);
+            const BYTE * ref = src + table[h];
+            table[h] = (std::uint32_t)(ip - src);
+            if ( ref >= ip || (std::size_t)(ip - ref) > max_offset || Read32( ref ) != seq ) {
+                ++ip;
+                continue;
+            }
+            const BYTE * m = ip + min_match;
+            const BYTE * r = ref + min_match;
+            while ( m < end && *m == *r ) {
+                ++m;
+                ++r;
+            }
+            op = WriteSequence( op, anchor, ip - anchor, ip - ref, m - ip );
+            ip = anchor = m;
+        }
+    }
+    op = WriteSequence( op, anchor, end - anchor, 0, 0 );
+    return op - dst;
+}
+
+// Decompress size bytes from src into exactly dst_size bytes at dst. False if the block is malformed or does
+// not come out at dst_size.
+inline bool StackDecompress( const BYTE * src, std::size_t size, BYTE * dst, std::size_t dst_size ) {
+    using namespace stack_compress_detail;
+    const BYTE * ip = src;
+    const BYTE * const end = src + size;
+    BYTE * op = dst;
+    BYTE * const op_end = dst + dst_size;
+    while ( ip < end ) {
+        const BYTE token = *ip++;
+        std::size_t literal_count = token >> 4;
+        if ( literal_count == 15 && !ReadLength( ip, end, literal_count ) ) {
+            return false;
+        }
+        if ( literal_count > (std::size_t)(end - ip) || literal_count > (std::size_t)(op_end - op) ) {
+            return false;
+        }
+        if ( literal_count ) {
+            std::memcpy( op, ip, literal_count );
+            ip += literal_count;
+            op += literal_count;
+        }
+        if ( ip == end ) {
+            break;
+        }
+
+        if ( end - ip < 2 ) {
+            return false;
+        }
+        const std::size_t offset = ip[0] | (std::size_t)ip[1] << 8;
+        ip += 2;
+        std::size_t match_length = token & 15;
+        if ( match_length == 15 && !ReadLength( ip, end, match_length ) ) {
+            return false;
+        }
+        match_length += min_match;
+        if ( !offset || offset > (std::size_t)(op - dst) || match_length > (std::size_t)(op_end - op) ) {
+            return false;
+        }
+        const BYTE * ref = op - offset;
+        if ( offset >= match_length ) {
+            std::memcpy( op, ref, match_length );
+            op += match_length;
+        } else {
+            // overlapping, a run of the last offset bytes
+            for ( std::size_t i = 0; i < match_length; ++i ) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == op_end;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <boost/context/stack_traits.hpp>
+
+typedef unsigned char BYTE;
+typedef BYTE *        PBYTE;
+typedef std::uint32_t DWORD;
+
+// Linux has no VirtualQuery to find the reservation a stack pointer lives in, so every stack we hand out
+// carries this header in its top-most bytes and is reserved so that its top is aligned to the reservation
+// size rounded up to a power of two. Walking the candidate alignments upwards from the page size finds the
+// header without any lookup structure, which keeps it usable from signal handlers and fault threads.
+struct stack_header {
+    static constexpr std::uint64_t magic_value = 0x6b6e69726873746bULL;
+
+    std::uint64_t  magic;
+    stack_header * self;
+    PBYTE          base;        // start of the reservation, guard region included
+    std::size_t    size;        // whole reservation in bytes
+    std::size_t    guard_size;  // PROT_NONE bytes at the bottom of the reservation
+
+    // filled in by the fault driven allocators, untouched when the kernel grows the stack on its own
+    std::atomic< std::uint64_t >  faults;   // page faults served for this stack
+    std::atomic< PBYTE >          deepest;  // lowest page a fault was served for, null before the first one
+
+    // set by allocators that keep everything below it PROT_NONE and grow the stack from a fault handler,
+    // null when the whole usable part is accessible
+    std::atomic< PBYTE >          committed;
+    std::atomic< std::uint32_t >  grow_pages;   // pages the next growth fault commits at once
+
+    // where the coroutine last parked, see StackPark, null if it never did. Shrink passes that run while it
+    // is suspended keep everything from the page below this one up.
+    std::atomic< PBYTE >          parked_sp;
+    std::atomic< std::uint32_t >  parks;        // bumped by every StackPark
+    std::uint32_t                 shrunk_parks; // parks as of the last shrink pass
+    PBYTE                         released_end; // everything below this was released by the last shrink pass
+
+    // kept by whoever resumes the coroutine when a stack_reclaimer_t may trim the stack from its own thread,
+    // see StackBeginResume and StackEndResume
+    std::atomic< std::uint32_t >  state;        // stack_running, stack_parked or stack_reclaiming
+    std::atomic< std::int64_t >   last_resume;  // steady_clock ticks when it was last resumed, 0 if never
+
+    // set on stacks picked for depth profiling, see stack_profile.hpp. StackShrink hands it the range it is
+    // about to release so the deepest use in there is not lost.
+    void                          ( *release_hook )( stack_header &, PBYTE, PBYTE );
+    void *                        profile;
+
+    // set by file_stack_space_t, the usable part is a MAP_SHARED mapping of a file on disk. Unmapping its pages
+    // leaves them in the page cache, releasing them means punching them out of the file (ReleaseStackPages).
+    bool                          file_backed;
+    // set for stacks on MAP_HUGETLB pages (stack_huge_pages::hugetlb), those can not be released page by page
+    bool                          hugetlb;
+
+    // kept by StackShrink once StackPrefault was called on the stack: the pages the coroutine used below the
+    // ones StackShrink keeps, [prefault_begin, prefault_end), null if there were none
+    bool                          prefault;
+    std::uint32_t                 prefaults;    // StackPrefault calls, some skip the prefault to measure again
+    PBYTE                         prefault_begin;
+    PBYTE                         prefault_end;
+
+    PBYTE usable() const { return base + guard_size; }
+    PBYTE top() const { return base + size; }
+    bool contains( const void * p ) const { return (PBYTE)p >= base && (PBYTE)p < top(); }
+};
+
+// stack_header::state
+enum stack_state : std::uint32_t {
+    stack_running,      // running, or never parked yet, nobody else may touch the pages below its stack pointer
+    stack_parked,       // suspended, a reclaimer may claim it
+    stack_reclaiming,   // claimed by a reclaimer that is releasing pages below parked_sp
+};
+
+// bytes reserved at the top of every stack for the header, keeps the stack pointer handed to boost 64 byte aligned
+constexpr std::size_t stack_header_size = (sizeof( stack_header ) + 63) & ~std::size_t( 63 );
+
+inline std::size_t stack_alignment( std::size_t size ) {
+    std::size_t align = boost::context::stack_traits::page_size();
+    while ( align < size ) {
+        align <<= 1;
+    }
+    return align;
+}
+
+inline stack_header * stack_header_at( PBYTE top ) {
+    auto hdr = reinterpret_cast< stack_header * >(top - stack_header_size);
+    if ( hdr->magic == stack_header::magic_value && hdr->self == hdr && hdr->top() == top ) {
+        return hdr;
+    }
+    return nullptr;
+}
+
+// Find the header of the stack that p (which must lie inside a stack handed out by one of our allocators,
+// at or below the live stack pointer) belongs to, when the stack's alignment is known.
+inline stack_header * find_stack_header( const void * p, std::size_t align ) {
+    PBYTE top = (PBYTE)(((uintptr_t)p & ~(uintptr_t)(align - 1)) + align);
+    return stack_header_at( top );
+}
+
+// Same as above but probes every power of two alignment, p must be the live stack pointer or above it.
+inline stack_header * find_stack_header( const void * p ) {
+    constexpr std::size_t max_align = std::size_t( 1 ) << 40;
+    for ( std::size_t align = boost::context::stack_traits::page_size(); align <= max_align; align <<= 1 ) {
+        if ( auto hdr = find_stack_header( p, align ) ) {
+            return hdr;
+        }
+    }
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <Psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "reserved_stack.hpp"
+#include "stack_profile.hpp"
+
+// One point of the memory time series of a process running coroutines.
+struct memory_sample {
+    double          time_s = 0;                 // since the sampler started
+    std::size_t     entities = 0;               // as last set with stack_metrics_t::set_entities
+    std::size_t     rss_bytes = 0;
+    std::size_t     pss_bytes = 0;              // pages shared with other processes split between them
+    std::size_t     anon_bytes = 0;             // resident anonymous pages, stacks included
+    std::uint64_t   minor_faults = 0;           // over the life of the process
+    std::uint64_t   major_faults = 0;
+    std::size_t     stacks = 0;                 // stacks handed out by metered_stack right now
+    std::size_t     committed_bytes = 0;        // resident pages of those stacks, see stack_metrics_t::sample
+    std::size_t     max_stack_committed = 0;    // the most any one of them had resident
+};
+
+// Fill in the process wide part of s. Linux reads /proc/self/smaps_rollup, which costs time in proportion to
+// the mappings of the process, about two per stack. Windows has no proportional set, PSS is the working set
+// there and the anonymous part the private commit charge.
+inline void QueryProcessMemory( memory_sample & s ) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof( counters );
+    if ( GetProcessMemoryInfo( GetCurrentProcess(), (PPROCESS_MEMORY_COUNTERS)&counters, sizeof( counters ) ) ) {
+        s.rss_bytes = counters.WorkingSetSize;
+        s.pss_bytes = counters.WorkingSetSize;
+        s.anon_bytes = counters.PrivateUsage;
+        s.minor_faults = counters.PageFaultCount;
+    }
+#else
+    std::ifstream rollup( "/proc/self/smaps_rollup" );
+    for ( std::string line; std::getline( rollup, line ); ) {
+        std::size_t * field = nullptr;
+        std::size_t skip = 0;
+        if ( 0 == line.compare( 0, 4, "Rss:" ) ) {
+            field = &s.rss_bytes, skip = 4;
+        } else if ( 0 == line.compare( 0, 4, "Pss:" ) ) {
+            field = &s.pss_bytes, skip = 4;
+        } else if ( 0 == line.compare( 0, 10, "Anonymous:" ) ) {
+            field = &s.anon_bytes, skip = 10;
+        }
+        if ( field ) {
+            *field = std::stoull( line.substr( skip ) ) * 1024;
+        }
+    }
+    rusage ru = {};
+    if ( 0 == ::getrusage( RUSAGE_SELF, &ru ) ) {
+        s.minor_faults = (std::uint64_t)ru.ru_minflt;
+        s.major_faults = (std::uint64_t)ru.ru_majflt;
+    }
+#endif
+}
+
+// Keeps track of the stacks metered_stack hands out, to count what they have resident. Counting looks at the
+// page tables (mincore, VirtualQuery), never at the stacks themselves, so it is safe while they run and does
+// not fault anything in.
+class stack_metrics_t {
+public:
+    stack_metrics_t() = default;
+    stack_metrics_t( const stack_metrics_t & ) = delete;
+    stack_metrics_t & operator=( const stack_metrics_t & ) = delete;
+
+    void add( const boost::context::stack_context & sctx ) {
+        PBYTE top = static_cast< PBYTE >(sctx.sp);
+        std::lock_guard< std::mutex > lock( mutex_ );
+        stacks_.emplace( top, top - sctx.size );
+    }
+
+    void remove( const boost::context::stack_context & sctx ) {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        BOOST_VERIFY( 1 == stacks_.erase( static_cast< PBYTE >(sctx.sp) ) );
+    }
+
+    // The number of entities the memory is plotted against, whatever the program counts as one.
+    void set_entities( std::size_t entities ) { entities_.store( entities, std::memory_order_relaxed ); }
+
+    // Resident bytes of every stack, in no particular order.
+    std::vector< std::size_t > committed_per_stack() const {
+        std::vector< std::size_t > committed;
+        for ( auto & range : ranges() ) {
+            committed.push_back( Committed( range.second, range.first ) );
+        }
+        return committed;
+    }
+
+    // Counting takes a few microseconds per stack, so with more than max_stacks of them only every n-th one
+    // is counted and the total scaled up, the maximum is the one of those counted.
+    memory_sample sample( std::size_t max_stacks = 2048 ) const {
+        memory_sample s;
+        s.entities = entities_.load( std::memory_order_relaxed );
+        QueryProcessMemory( s );
+        auto stacks = ranges();
+        s.stacks = stacks.size();
+        const std::size_t stride = (stacks.size() + max_stacks - 1) / std::max< std::size_t >( max_stacks, 1 );
+        std::size_t counted = 0;
+        for ( std::size_t i = 0; i < stacks.size(); i += stride, ++counted ) {
+            const std::size_t committed = Committed( stacks[i].second, stacks[i].first );
+            s.committed_bytes += committed;
+            s.max_stack_committed = (std::max)( s.max_stack_committed, committed );
+        }
+        if ( counted ) {
+            s.committed_bytes = (std::size_t)((double)s.committed_bytes * s.stacks / counted);
+        }
+        return s;
+    }
+
+private:
+    // a copy, so the stacks are counted without holding up allocations. One released in the meantime
+    // counts as nothing resident.
+    std::vector< std::pair< PBYTE, PBYTE > > ranges() const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return std::vector< std::pair< PBYTE, PBYTE > >( stacks_.begin(), stacks_.end() );
+    }
+
+    static std::size_t Committed( PBYTE lo, PBYTE hi ) {
+        std::size_t bytes = 0;
+        ForEachResidentRange( lo, hi, [&]( PBYTE begin, PBYTE end ) {
+            bytes += end - begin;
+            return true;
+        } );
+        return bytes;
+    }
+
+    mutable std::mutex                      mutex_;
+    std::unordered_map< PBYTE, PBYTE >      stacks_;    // top to bottom
+    std::atomic< std::size_t >              entities_{ 0 };
+};
+
+// StackAllocator that registers the stacks of another one with a stack_metrics_t for as long as they are
+// handed out. Any allocator works, the range counted is the one in the stack_context.
+template< typename StackAllocator >
+class metered_stack {
+private:
+    StackAllocator      inner_;
+    stack_metrics_t *   metrics_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    metered_stack( stack_metrics_t & metrics, StackAllocator inner ) :
+        inner_( std::move( inner ) ), metrics_( &metrics ) {
+    }
+
+    stack_context allocate() {
+        stack_context sctx = inner_.allocate();
+        metrics_->add( sctx );
+        return sctx;
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        metrics_->remove( sctx );
+        inner_.deallocate( sctx );
+    }
+};
+
+// Takes a memory_sample every period from a thread of its own and hands it to a callback on that thread, to
+// plot memory against the entity count while a benchmark runs. A sample reads smaps_rollup, which gets slow
+// with tens of thousands of stacks, so the wait after one is stretched to nine times what it took if period
+// is shorter than that: the sampler never takes more than a tenth of a core away from the coroutines.
+class memory_sampler_t {
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    memory_sampler_t( const stack_metrics_t & metrics, clock_type::duration period,
+                      std::function< void( const memory_sample & ) > fn ) :
+        metrics_( metrics ), period_( period ), fn_( std::move( fn ) ), start_( clock_type::now() ) {
+        thread_ = std::thread( [this] { run(); } );
+    }
+
+    // takes a last sample on the way out, so a short run has at least one
+    ~memory_sampler_t() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    memory_sampler_t( const memory_sampler_t & ) = delete;
+    memory_sampler_t & operator=( const memory_sampler_t & ) = delete;
+
+private:
+    void run() {
+        std::unique_lock< std::mutex > lock( mutex_ );
+        clock_type::duration wait = period_;
+        for ( bool last = false; !last; ) {
+            last = wake_.wait_until( lock, clock_type::now() + wait, [this] { return stop_; } );
+            lock.unlock();
+            auto start = clock_type::now();
+            memory_sample s = metrics_.sample();
+            s.time_s = std::chrono::duration< double >( start - start_ ).count();
+            fn_( s );
+            wait = (std::max)( period_, 9 * (clock_type::now() - start) );
+            lock.lock();
+        }
+    }
+
+    const stack_metrics_t &                         metrics_;
+    const clock_type::duration                      period_;
+    std::function< void( const memory_sample & ) >  fn_;
+    const clock_type::time_point                    start_;
+    std::mutex                                      mutex_;
+    std::condition_variable                         wake_;
+    bool                                            stop_ = false;
+    std::thread                                     thread_;
+};
+
+// CSV, one line per sample under a header line.
+inline void WriteSampleHeader( std::ostream & out ) {
+    out << "time_s,entities,rss,pss,anon,minor_faults,major_faults,stacks,committed,max_stack_committed\n";
+}
+
+inline void WriteSample( std::ostream & out, const memory_sample & s ) {
+    out << s.time_s << ',' << s.entities << ',' << s.rss_bytes << ',' << s.pss_bytes << ',' << s.anon_bytes << ','
+        << s.minor_faults << ',' << s.major_faults << ',' << s.stacks << ',' << s.committed_bytes << ','
+        << s.max_stack_committed << '\n';
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <boost/coroutine2/all.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "reserved_stack.hpp"
+#include "stack_compress.hpp"
+
+struct stack_park_stats {
+    std::uint64_t parks = 0;
+    std::uint64_t restores = 0;
+    std::uint64_t raw_bytes = 0;            // live bytes compressed, over all parks
+    std::uint64_t compressed_bytes = 0;     // what they came down to
+    std::uint64_t released_pages = 0;       // pages handed back, resident or not
+    std::size_t   parked_bytes = 0;         // compressed bytes held by coroutines parked right now
+    double        park_s = 0;
+    double        restore_s = 0;
+    double        max_restore_s = 0;
+
+    double ratio() const { return compressed_bytes ? (double)raw_bytes / compressed_bytes : 0.0; }
+    double mean_restore_s() const { return restores ? restore_s / restores : 0.0; }
+};
+
+// Compressed parking for coroutines that sleep for a long time. Parking compresses the live part of a
+// suspended coroutine's stack, from the page below the one it called StackPark in up to the page holding the
+// stack_header, into a buffer of exactly the compressed size, and releases every page of the stack but the
+// header's. Restoring commits the pages again in one go and decompresses the bytes back to the same
+// addresses, so every pointer into the stack stays valid.
+//
+// Works on the stacks of reserved_fixedsize_stack and the other allocators with a stack_header whose pages
+// are plain read/write, not on the fault grown ones. Not thread safe, use one per thread.
+class stack_parking_t {
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    // What a parked coroutine keeps instead of its pages.
+    struct parked {
+        PBYTE                       begin = nullptr;    // first byte of the live part, null when not parked
+        std::size_t                 size = 0;           // bytes in the live part
+        std::unique_ptr< BYTE[] >   data;
+        std::size_t                 data_size = 0;
+    };
+
+    stack_parking_t() = default;
+    stack_parking_t( const stack_parking_t & ) = delete;
+    stack_parking_t & operator=( const stack_parking_t & ) = delete;
+
+    // Park the suspended coroutine the stack belongs to. Does nothing for a stack that never called StackPark.
+    // The coroutine must have called it before its last suspend, frames below an older park point are lost;
+    // parkable_coroutine keeps track of that.
+    void park( stack_header * hdr, parked & p ) {
+        BOOST_ASSERT( !p.begin );
+        BOOST_ASSERT_MSG( !hdr->committed.load( std::memory_order_relaxed ), "fault grown stacks can not be parked" );
+        PBYTE sp = hdr->parked_sp.load( std::memory_order_relaxed );
+        if ( !sp ) {
+            return;
+        }
+        const auto page_size = boost::context::stack_traits::page_size();
+        auto start = clock_type::now();
+
+        // the same bounds StackShrink keeps, the context switch left its frames in the page below
+        PBYTE pBegin = std::max( hdr->usable(), sp - ((uintptr_t)sp & (page_size - 1)) - page_size );
+        PBYTE pEnd = (PBYTE)hdr - ((uintptr_t)hdr & (page_size - 1));
+        if ( pEnd <= pBegin ) {
+            return;
+        }
+        scratch_.resize( StackCompressBound( pEnd - pBegin ) );
+        p.data_size = StackCompress( pBegin, pEnd - pBegin, scratch_.data() );
+        p.data.reset( new BYTE[p.data_size] );
+        std::copy( scratch_.data(), scratch_.data() + p.data_size, p.data.get() );
+        p.begin = pBegin;
+        p.size = pEnd - pBegin;
+        ReleaseStackPages( *hdr, hdr->usable(), pEnd );
+
+        ++stats_.parks;
+        stats_.raw_bytes += p.size;
+        stats_.compressed_bytes += p.data_size;
+        stats_.released_pages += (pEnd - hdr->usable()) / page_size;
+        stats_.parked_bytes += p.data_size;
+        stats_.park_s += std::chrono::duration< double >( clock_type::now() - start ).count();
+    }
+
+    // Put a parked coroutine's stack back the way it was parked.
+    void restore( parked & p ) {
+        BOOST_ASSERT( p.begin );
+        auto start = clock_type::now();
+        CommitPages( p.begin, p.size );
+        if ( !StackDecompress( p.data.get(), p.data_size, p.begin, p.size ) ) {
+            // only a bug in the codec gets here, and the coroutine's frames are gone with it
+            throw std::logic_error( "parked stack does not decompress" );
+        }
+        stats_.parked_bytes -= p.data_size;
+        p.data.reset();
+        p.data_size = 0;
+        p.begin = nullptr;
+
+        const double elapsed = std::chrono::duration< double >( clock_type::now() - start ).count();
+        ++stats_.restores;
+        stats_.restore_s += elapsed;
+        stats_.max_restore_s = std::max( stats_.max_restore_s, elapsed );
+    }
+
+    stack_park_stats stats() const { return stats_; }
+
+private:
+    std::vector< BYTE > scratch_;
+    stack_park_stats    stats_;
+};
+
+// A push coroutine that can be parked with stack_parking_t while it is suspended, and is restored on its next
+// resume. Its body calls StackPark() right before it suspends, park() leaves it alone if it suspended without
+// doing so. The header of its stack is picked up on the first resume, so the stack allocator can be any of
+// ours that stack_parking_t works with. Destroying a parked one restores it first, unwinding needs the frames.
+class parkable_coroutine {
+public:
+    typedef boost::coroutines2::coroutine< void > co_type;
+
+    template< typename StackAllocator, typename Fn >
+    parkable_coroutine( stack_parking_t & parking, StackAllocator && stack, Fn && fn ) :
+        state_( new state{ &parking, nullptr, 0, {} } ),
+        co_( std::forward< StackAllocator >( stack ),
+             [s = state_.get(), fn = std::forward< Fn >( fn )]( co_type::pull_type & c ) mutable {
+                 s->hdr = find_stack_header( GetStackPointer() );
+                 s->resume_parks = s->hdr->parks.load( std::memory_order_relaxed );
+                 fn( c );
+             } ) {
+    }
+
+    parkable_coroutine( parkable_coroutine && ) = default;
+
+    parkable_coroutine & operator=( parkable_coroutine && other ) {
+        unpark();
+        co_ = std::move( other.co_ );
+        state_ = std::move( other.state_ );
+        return *this;
+    }
+
+    ~parkable_coroutine() {
+        unpark();
+    }
+
+    void operator()() {
+        unpark();
+        if ( state_->hdr ) {
+            state_->resume_parks = state_->hdr->parks.load( std::memory_order_relaxed );
+        }
+        co_();
+    }
+
+    // Compress and release the stack until the next resume. Only while suspended.
+    void park() {
+        if ( state_->hdr && !state_->p.begin && co_
+             && state_->hdr->parks.load( std::memory_order_relaxed ) != state_->resume_parks ) {
+            state_->parking->park( state_->hdr, state_->p );
+        }
+    }
+
+    bool parked() const { return state_ && state_->p.begin; }
+
+    explicit operator bool() const BOOST_NOEXCEPT_OR_NOTHROW { return static_cast< bool >( co_ ); }
+
+private:
+    struct state {
+        stack_parking_t *           parking;
+        stack_header *              hdr;
+        std::uint32_t               resume_parks;   // hdr->parks when it was last resumed
+        stack_parking_t::parked     p;
+    };
+
+    void unpark() {
+        if ( parked() ) {
+            state_->parking->restore( state_->p );
+        }
+    }
+
+    // declared first so the coroutine, and with it any unwinding, goes before the state it captured
+    std::unique_ptr< state >    state_;
+    co_type::push_type          co_;
+};
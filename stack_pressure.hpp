@@ -0,0 +1,344 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "stack_metrics.hpp"
+#include "stack_reclaimer.hpp"
+
+// How short the system is of memory, in the terms of PSI: some tasks stall on memory, or all of them do.
+enum class memory_pressure {
+    none,
+    some,
+    full,
+};
+
+// Where a stack_pressure_monitor_t learns about memory pressure. wait returns as soon as there is pressure
+// to report, or after at most timeout with none if there is nothing new.
+class memory_pressure_source {
+public:
+    virtual ~memory_pressure_source() = default;
+    virtual memory_pressure wait( std::chrono::milliseconds timeout ) = 0;
+};
+
+// PSI triggers on /proc/pressure/memory, or a cgroup's memory.pressure: the kernel wakes us once tasks have
+// stalled on memory for stall out of any window, some of them for memory_pressure::some, all of them for full.
+// Needs a 4.20 kernel built with CONFIG_PSI, and without CAP_SYS_RESOURCE a window of a multiple of 2 seconds.
+class psi_pressure_source : public memory_pressure_source {
+public:
+    psi_pressure_source( std::chrono::microseconds stall = std::chrono::milliseconds( 150 ),
+                         std::chrono::microseconds window = std::chrono::seconds( 2 ),
+                         const char * path = "/proc/pressure/memory" ) {
+        // one trigger per file descriptor
+        some_ = open_trigger( path, "some", stall, window );
+        full_ = open_trigger( path, "full", stall, window );
+    }
+
+    ~psi_pressure_source() {
+        ::close( some_ );
+        ::close( full_ );
+    }
+
+    psi_pressure_source( const psi_pressure_source & ) = delete;
+    psi_pressure_source & operator=( const psi_pressure_source & ) = delete;
+
+    memory_pressure wait( std::chrono::milliseconds timeout ) override {
+        pollfd fds[2] = { { some_, POLLPRI, 0 }, { full_, POLLPRI, 0 } };
+        if ( ::poll( fds, 2, (int)timeout.count() ) <= 0 ) {
+            return memory_pressure::none;
+        }
+        if ( (fds[0].revents | fds[1].revents) & POLLERR ) {
+            // the cgroup went away, it will not see pressure again and poll would not wait any more
+            std::this_thread::sleep_for( timeout );
+            return memory_pressure::none;
+        }
+        if ( fds[1].revents & POLLPRI ) {
+            return memory_pressure::full;
+        }
+        return fds[0].revents & POLLPRI ? memory_pressure::some : memory_pressure::none;
+    }
+
+private:
+    static int open_trigger( const char * path, const char * kind, std::chrono::microseconds stall,
+                             std::chrono::microseconds window ) {
+        int fd = ::open( path, O_RDWR | O_NONBLOCK | O_CLOEXEC );
+        if ( fd < 0 ) {
+            throw std::system_error( errno, std::system_category(), path );
+        }
+        char trigger[64];
+        const int length = std::snprintf( trigger, sizeof( trigger ), "%s %lld %lld", kind,
+                                          (long long)stall.count(), (long long)window.count() );
+        // the terminating zero goes with it
+        if ( ::write( fd, trigger, length + 1 ) < 0 ) {
+            const int error = errno;
+            ::close( fd );
+            throw std::system_error( error, std::system_category(), path );
+        }
+        return fd;
+    }
+
+    int some_ = -1;
+    int full_ = -1;
+};
+
+// The memory.events file of a cgroup v2, the one the process runs in unless told otherwise. The kernel
+// notifies a change of any of its counters: a new high event, the cgroup over memory.high and throttled into
+// reclaim, is memory_pressure::some, a new max or oom event, the cgroup at its hard limit, is full.
+class cgroup_pressure_source : public memory_pressure_source {
+public:
+    explicit cgroup_pressure_source( std::string cgroup_dir = OwnCgroupDir() ) {
+        const std::string path = cgroup_dir + "/memory.events";
+        fd_ = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+        if ( fd_ < 0 ) {
+            throw std::system_error( errno, std::system_category(), path );
+        }
+        last_ = read_events();
+    }
+
+    ~cgroup_pressure_source() {
+        ::close( fd_ );
+    }
+
+    cgroup_pressure_source( const cgroup_pressure_source & ) = delete;
+    cgroup_pressure_source & operator=( const cgroup_pressure_source & ) = delete;
+
+    memory_pressure wait( std::chrono::milliseconds timeout ) override {
+        pollfd fd = { fd_, POLLPRI, 0 };
+        if ( ::poll( &fd, 1, (int)timeout.count() ) <= 0 ) {
+            return memory_pressure::none;
+        }
+        const events now = read_events();
+        const events last = std::exchange( last_, now );
+        if ( now.max > last.max || now.oom > last.oom ) {
+            return memory_pressure::full;
+        }
+        return now.high > last.high ? memory_pressure::some : memory_pressure::none;
+    }
+
+    // /sys/fs/cgroup plus the path of the process' cgroup v2 from /proc/self/cgroup
+    static std::string OwnCgroupDir() {
+        std::ifstream cgroup( "/proc/self/cgroup" );
+        for ( std::string line; std::getline( cgroup, line ); ) {
+            if ( 0 == line.compare( 0, 3, "0::" ) && line.size() > 4 ) {
+                return "/sys/fs/cgroup" + line.substr( 3 );
+            }
+        }
+        return "/sys/fs/cgroup";
+    }
+
+private:
+    struct events {
+        std::uint64_t high = 0;
+        std::uint64_t max = 0;
+        std::uint64_t oom = 0;
+    };
+
+    events read_events() {
+        char buffer[512];
+        const ssize_t length = ::pread( fd_, buffer, sizeof( buffer ) - 1, 0 );
+        events e;
+        if ( length <= 0 ) {
+            return e;
+        }
+        buffer[length] = 0;
+        for ( const char * line = buffer; line; line = std::strchr( line, '\n' ) ) {
+            line += *line == '\n';
+            unsigned long long value = 0;
+            if ( 1 == std::sscanf( line, "high %llu", &value ) ) {
+                e.high = value;
+            } else if ( 1 == std::sscanf( line, "max %llu", &value ) ) {
+                e.max = value;
+            } else if ( 1 == std::sscanf( line, "oom %llu", &value ) ) {
+                e.oom = value;
+            }
+        }
+        return e;
+    }
+
+    int     fd_ = -1;
+    events  last_;
+};
+
+// A source whose level is set from outside, by a test or a demo that fakes pressure, or by anything else that
+// knows better. Stays at a level until it is set again, wait reports it on every change and after every
+// timeout.
+class manual_pressure_source : public memory_pressure_source {
+public:
+    void set( memory_pressure level ) {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            level_ = level;
+            ++changes_;
+        }
+        changed_.notify_all();
+    }
+
+    memory_pressure wait( std::chrono::milliseconds timeout ) override {
+        std::unique_lock< std::mutex > lock( mutex_ );
+        const std::uint64_t changes = changes_;
+        changed_.wait_for( lock, timeout, [&] { return changes_ != changes; } );
+        return level_;
+    }
+
+private:
+    std::mutex              mutex_;
+    std::condition_variable changed_;
+    memory_pressure         level_ = memory_pressure::none;
+    std::uint64_t           changes_ = 0;
+};
+
+// Pressure from the resident set of the process against two thresholds of our own, for hosts without PSI or a
+// memory limit: some from soft_bytes up, full from hard_bytes up. Fed by a memory_sampler_t, call sample from
+// its callback.
+class rss_pressure_source : public manual_pressure_source {
+public:
+    rss_pressure_source( std::size_t soft_bytes, std::size_t hard_bytes ) :
+        soft_bytes_( soft_bytes ), hard_bytes_( std::max( soft_bytes, hard_bytes ) ) {
+    }
+
+    void sample( const memory_sample & s ) {
+        set( s.rss_bytes >= hard_bytes_ ? memory_pressure::full
+             : s.rss_bytes >= soft_bytes_ ? memory_pressure::some : memory_pressure::none );
+    }
+
+private:
+    const std::size_t soft_bytes_;
+    const std::size_t hard_bytes_;
+};
+
+// The steps a stack_pressure_monitor_t escalates through while pressure keeps up.
+enum class pressure_step {
+    lazy,       // stacks parked for longer than the reclaimer's idle time, MADV_FREE: only taken if the kernel
+                // gets round to it, regrowing costs nothing until then
+    parked,     // every parked stack, MADV_DONTNEED
+    drain,      // that again, and the hooks drop whatever they keep cached, stack pools first of all
+};
+
+struct stack_pressure_stats {
+    std::uint64_t events = 0;           // pressure the source reported
+    std::uint64_t passes[3] = {};       // reclaim passes, by pressure_step
+    std::uint64_t released_pages = 0;   // by the reclaimer in those passes, resident or not
+};
+
+// Reclaims stacks when the system is short of memory and leaves them alone while it is not. A thread of its
+// own waits on a memory_pressure_source; on pressure it runs a reclaim pass, no more often than once per
+// cooldown, starting at pressure_step::lazy and one step further every time pressure is back within escalate
+// of the last pass. full pressure goes straight to drain. Once there was no pressure for escalate the next
+// episode starts lazy again.
+//
+// The stack_reclaimer_t is best created with a period of clock_type::duration::max() so it only runs the passes
+// asked for here. Hooks run on the monitor's thread after the reclaimer pass of every step: anything they
+// touch that is not thread safe, like a stack_pool_t, has to be locked or handed to its owner.
+class stack_pressure_monitor_t {
+public:
+    typedef std::chrono::steady_clock clock_type;
+    typedef std::function< void( pressure_step ) > hook_type;
+
+    stack_pressure_monitor_t( memory_pressure_source & source, stack_reclaimer_t & reclaimer,
+                              clock_type::duration cooldown = std::chrono::seconds( 1 ),
+                              clock_type::duration escalate = std::chrono::seconds( 5 ) ) :
+        source_( source ), reclaimer_( reclaimer ), cooldown_( cooldown ), escalate_( std::max( escalate, cooldown ) ) {
+        thread_ = std::thread( [this] { run(); } );
+    }
+
+    ~stack_pressure_monitor_t() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        thread_.join();
+    }
+
+    stack_pressure_monitor_t( const stack_pressure_monitor_t & ) = delete;
+    stack_pressure_monitor_t & operator=( const stack_pressure_monitor_t & ) = delete;
+
+    void add_hook( hook_type hook ) {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        hooks_.push_back( std::move( hook ) );
+    }
+
+    stack_pressure_stats stats() const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return stats_;
+    }
+
+private:
+    // how often the thread looks at stop_ while the source has nothing to say
+    static constexpr std::chrono::milliseconds poll_timeout{ 100 };
+
+    void run() {
+        clock_type::time_point last_pass;
+        bool escalating = false;
+        pressure_step step = pressure_step::lazy;
+        for ( ;; ) {
+            const memory_pressure level = source_.wait( poll_timeout );
+            std::vector< hook_type > hooks;
+            {
+                std::lock_guard< std::mutex > lock( mutex_ );
+                if ( stop_ ) {
+                    return;
+                }
+                if ( level == memory_pressure::none ) {
+                    continue;
+                }
+                ++stats_.events;
+                hooks = hooks_;
+            }
+
+            const auto now = clock_type::now();
+            if ( escalating && now - last_pass < cooldown_ ) {
+                continue;
+            }
+            if ( escalating && now - last_pass < escalate_ ) {
+                step = step == pressure_step::lazy ? pressure_step::parked : pressure_step::drain;
+            } else {
+                step = pressure_step::lazy;
+            }
+            if ( level == memory_pressure::full ) {
+                step = pressure_step::drain;
+            }
+
+            const std::uint64_t pages = step == pressure_step::lazy
+                ? reclaimer_.reclaim_now( reclaimer_.idle(), stack_release::free )
+                : reclaimer_.reclaim_now( clock_type::duration::zero(), stack_release::dontneed );
+            for ( auto & hook : hooks ) {
+                hook( step );
+            }
+            last_pass = clock_type::now();
+            escalating = true;
+
+            std::lock_guard< std::mutex > lock( mutex_ );
+            ++stats_.passes[(int)step];
+            stats_.released_pages += pages;
+        }
+    }
+
+    memory_pressure_source &        source_;
+    stack_reclaimer_t &             reclaimer_;
+    const clock_type::duration      cooldown_;
+    const clock_type::duration      escalate_;
+    mutable std::mutex              mutex_;
+    bool                            stop_ = false;
+    std::vector< hook_type >        hooks_;
+    stack_pressure_stats            stats_;
+    std::thread                     thread_;
+};
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || (defined( _M_IX86_FP ) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define STACK_PROFILE_SSE2 1
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "reserved_stack.hpp"
+
+// what a profiled stack is filled with before the coroutine gets it
+constexpr std::uint32_t stack_paint_value = 0xa5a5a5a5u;
+
+// Lowest address in [begin, end) whose 32 bit word differs from fill, end if there is none. Both ends must be
+// 16 byte aligned.
+inline PBYTE FindOverwritten( PBYTE begin, PBYTE end, std::uint32_t fill ) {
+    BOOST_ASSERT( 0 == ((uintptr_t)begin & 15) && 0 == ((uintptr_t)end & 15) );
+#ifdef STACK_PROFILE_SSE2
+    const __m128i v = _mm_set1_epi32( (int)fill );
+    for ( ; begin + 64 <= end; begin += 64 ) {
+        __m128i a = _mm_cmpeq_epi32( _mm_load_si128( (const __m128i *)begin ), v );
+        __m128i b = _mm_cmpeq_epi32( _mm_load_si128( (const __m128i *)(begin + 16) ), v );
+        __m128i c = _mm_cmpeq_epi32( _mm_load_si128( (const __m128i *)(begin + 32) ), v );
+        __m128i d = _mm_cmpeq_epi32( _mm_load_si128( (const __m128i *)(begin + 48) ), v );
+        if ( 0xffff != _mm_movemask_epi8( _mm_and_si128( _mm_and_si128( a, b ), _mm_and_si128( c, d ) ) ) ) {
+            break;
+        }
+    }
+#else
+    const std::uint64_t fill64 = ((std::uint64_t)fill << 32) | fill;
+    for ( ; begin + 8 <= end; begin += 8 ) {
+        if ( *(const std::uint64_t *)begin != fill64 ) {
+            break;
+        }
+    }
+#endif
+    // narrow the block down to the word
+    for ( ; begin < end; begin += 4 ) {
+        if ( *(const std::uint32_t *)begin != fill ) {
+            return begin;
+        }
+    }
+    return end;
+}
+
+// Call fn( begin, end ) for the runs of pages in [lo, hi) that are backed by memory right now, lowest first,
+// until it returns false. Reading anything else would fault it in, or trip a guard.
+template< typename Fn >
+void ForEachResidentRange( PBYTE lo, PBYTE hi, Fn && fn ) {
+#ifdef _WIN32
+    while ( lo < hi ) {
+        MEMORY_BASIC_INFORMATION info;
+        if ( !VirtualQuery( lo, &info, sizeof( info ) ) ) {
+            return;
+        }
+        PBYTE end = (std::min)( (PBYTE)info.BaseAddress + info.RegionSize, hi );
+        if ( info.State == MEM_COMMIT && !(info.Protect & (PAGE_GUARD | PAGE_NOACCESS)) && !fn( lo, end ) ) {
+            return;
+        }
+        lo = end;
+    }
+#else
+    const auto page_size = boost::context::stack_traits::page_size();
+    unsigned char vec[256];
+    PBYTE run = nullptr;
+    while ( lo < hi ) {
+        const std::size_t pages = std::min< std::size_t >( (hi - lo + page_size - 1) / page_size, sizeof( vec ) );
+        if ( 0 != ::mincore( lo, pages * page_size, vec ) ) {
+            std::fill( vec, vec + pages, 0 );
+        }
+        for ( std::size_t i = 0; i < pages; ++i, lo += page_size ) {
+            if ( vec[i] & 1 ) {
+                if ( !run ) run = lo;
+            } else if ( run ) {
+                if ( !fn( run, (std::min)( lo, hi ) ) ) return;
+                run = nullptr;
+            }
+        }
+    }
+    if ( run ) {
+        fn( run, hi );
+    }
+#endif
+}
+
+// Deepest use of a stack whose pages from painted up were painted, null if nothing in [lo, hi) was written.
+// Below painted there are only pages the kernel filled with zeroes when the stack grew into them, so there a
+// zero word counts as untouched: zeroes at the very bottom of the deepest frame go unnoticed.
+inline PBYTE FindDeepestUse( PBYTE lo, PBYTE hi, PBYTE painted ) {
+    PBYTE deepest = nullptr;
+    ForEachResidentRange( lo, hi, [&]( PBYTE begin, PBYTE end ) {
+        PBYTE split = (std::min)( (std::max)( painted, begin ), end );
+        PBYTE p = FindOverwritten( begin, split, 0 );
+        if ( p == split ) {
+            p = FindOverwritten( split, end, stack_paint_value );
+        }
+        if ( p != end ) {
+            deepest = p;
+        }
+        return !deepest;
+    } );
+    return deepest;
+}
+
+// Power of two histogram of the stack depth coroutines of one entry point reached.
+struct stack_depth_histogram {
+    static constexpr std::size_t num_buckets = 16;
+
+    std::uint64_t samples = 0;
+    std::uint64_t total_depth = 0;
+    std::size_t   max_depth = 0;
+    std::uint64_t buckets[num_buckets] = {};   // bucket i counts depths up to 1 KiB << i, the last one the rest
+
+    static std::size_t bucket_limit( std::size_t i ) { return std::size_t( 1024 ) << i; }
+
+    void add( std::size_t depth ) {
+        std::size_t i = 0;
+        while ( i + 1 < num_buckets && depth > bucket_limit( i ) ) {
+            ++i;
+        }
+        ++buckets[i];
+        ++samples;
+        total_depth += depth;
+        max_depth = (std::max)( max_depth, depth );
+    }
+
+    // upper bound of the bucket that holds the q quantile
+    std::size_t quantile( double q ) const {
+        std::uint64_t seen = 0;
+        for ( std::size_t i = 0; i < num_buckets; ++i ) {
+            seen += buckets[i];
+            if ( seen && seen >= q * samples ) {
+                return (std::min)( bucket_limit( i ), max_depth );
+            }
+        }
+        return max_depth;
+    }
+};
+
+// Opt-in stack depth profiling for a fraction of the stacks handed out through profiled_stack, or any other
+// allocator that calls begin or track and end. A sampled stack has its resident part painted before the
+// coroutine starts on it, and is scanned for the deepest overwritten word when it is shrunk (Linux only,
+// through stack_header::release_hook) and when the coroutine finishes. The deepest point over its whole life
+// goes into the histogram of its entry point. Unsampled stacks cost one random draw. Thread safe.
+class stack_profiler_t {
+public:
+    // every sample_every-th stack is profiled, 0 turns profiling off
+    explicit stack_profiler_t( std::uint32_t sample_every ) : sample_every_( sample_every ) {
+    }
+
+    stack_profiler_t( const stack_profiler_t & ) = delete;
+    stack_profiler_t & operator=( const stack_profiler_t & ) = delete;
+
+    // Whether the next stack is one of the sampled ones.
+    bool should_sample() {
+        return sample_every_ && 0 == draw() % sample_every_;
+    }
+
+    void begin( const boost::context::stack_context & sctx, const char * entry_point ) {
+        if ( should_sample() ) {
+            track( sctx, entry_point );
+        }
+    }
+
+    // Profile this stack whatever the sampling says. Painting starts at the lowest resident page, or at
+    // paint_from if that is lower, which catches even zeroes written into the pages in between. Windows can only
+    // paint what is committed already, paint_from is ignored there.
+    void track( const boost::context::stack_context & sctx, const char * entry_point, PBYTE paint_from = nullptr ) {
+        PBYTE top = (PBYTE)sctx.sp;
+        PBYTE lo = top - sctx.size;
+        // from the lowest resident page up, a hole in there would otherwise come back zero filled later on
+        PBYTE painted = top;
+        ForEachResidentRange( lo, top, [&]( PBYTE begin, PBYTE ) {
+            painted = begin;
+            return false;
+        } );
+#ifndef _WIN32
+        if ( paint_from && paint_from < painted ) {
+            painted = paint_from;
+        }
+#endif
+        std::fill( (std::uint32_t *)painted, (std::uint32_t *)top, stack_paint_value );
+
+        tracked_.fetch_add( 1, std::memory_order_relaxed );
+        std::lock_guard< std::mutex > lock( mutex_ );
+        sample & s = live_[top];
+        s = sample{ entry_point, lo, painted, nullptr };
+#ifndef _WIN32
+        auto hdr = reinterpret_cast< stack_header * >(top);
+        hdr->profile = &s;
+        hdr->release_hook = &on_release;
+#endif
+    }
+
+    // Call before the stack goes back to its allocator. Returns the deepest use in bytes below sctx.sp for a
+    // stack that was profiled, nothing for the others.
+    std::optional< std::size_t > end( const boost::context::stack_context & sctx ) {
+        if ( !tracked_.load( std::memory_order_relaxed ) ) {
+            return std::nullopt;
+        }
+        PBYTE top = (PBYTE)sctx.sp;
+        decltype( live_ )::node_type node;
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            node = live_.extract( top );
+        }
+        if ( !node ) {
+            return std::nullopt;
+        }
+        tracked_.fetch_sub( 1, std::memory_order_relaxed );
+        sample & s = node.mapped();
+#ifndef _WIN32
+        auto hdr = reinterpret_cast< stack_header * >(top);
+        hdr->release_hook = nullptr;
+        hdr->profile = nullptr;
+#endif
+        s.note( FindDeepestUse( s.lo, top, s.painted ) );
+        const std::size_t depth = s.deepest ? top - s.deepest : 0;
+
+        std::lock_guard< std::mutex > lock( mutex_ );
+        histograms_[s.entry_point].add( depth );
+        return depth;
+    }
+
+    std::map< std::string, stack_depth_histogram > histograms() const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return histograms_;
+    }
+
+    void print( std::ostream & out ) const {
+        for ( auto & [entry_point, h] : histograms() ) {
+            out << entry_point << ": " << h.samples << " samples, mean " << (h.total_depth / h.samples) / 1024
+                << " KiB, p50 <= " << h.quantile( 0.5 ) / 1024 << " KiB, p99 <= " << h.quantile( 0.99 ) / 1024
+                << " KiB, max " << h.max_depth / 1024 << " KiB" << std::endl;
+            for ( std::size_t i = 0; i < stack_depth_histogram::num_buckets; ++i ) {
+                if ( h.buckets[i] ) {
+                    out << "  <= " << std::setw( 6 ) << stack_depth_histogram::bucket_limit( i ) / 1024 << " KiB "
+                        << std::setw( 10 ) << h.buckets[i] << std::endl;
+                }
+            }
+        }
+    }
+
+    std::uint32_t sample_every() const { return sample_every_; }
+
+private:
+    struct sample {
+        const char *    entry_point;
+        PBYTE           lo;         // bottom of the stack, guard included
+        PBYTE           painted;    // everything from here up was painted, below it zero filled
+        PBYTE           deepest;    // deepest use seen by the scans so far
+
+        void note( PBYTE p ) {
+            if ( p && (!deepest || p < deepest) ) {
+                deepest = p;
+            }
+        }
+    };
+
+    // xorshift32, per thread so unsampled stacks do not share a cache line, and random so a fixed pattern in
+    // the order stacks are allocated in can not line up with the sampling
+    static std::uint32_t draw() {
+        static thread_local std::uint32_t state = 0x9e3779b9u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+#ifndef _WIN32
+    // Runs on the coroutine itself, or on a stack_reclaimer_t thread while it is parked, nobody else touches
+    // its sample while it is alive. The released pages come back zero filled, so they leave the painted part.
+    static void on_release( stack_header & hdr, PBYTE begin, PBYTE end ) {
+        sample & s = *static_cast< sample * >(hdr.profile);
+        s.note( FindDeepestUse( begin, end, s.painted ) );
+        s.painted = (std::max)( s.painted, end );
+    }
+#endif
+
+    const std::uint32_t                             sample_every_;
+    std::atomic< std::size_t >                      tracked_{ 0 };     // stacks in live_
+    mutable std::mutex                              mutex_;
+    std::map< PBYTE, sample >                       live_;
+    std::map< std::string, stack_depth_histogram >  histograms_;
+};
+
+// StackAllocator that hands the stacks of another one through a stack_profiler_t, charging them to entry_point.
+// Use one per entry point. On Linux the profiler keeps its state in the stack_header, so the inner allocator
+// has to be one of ours.
+template< typename StackAllocator >
+class profiled_stack {
+private:
+    StackAllocator      inner_;
+    stack_profiler_t *  profiler_;
+    const char *        entry_point_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    profiled_stack( stack_profiler_t & profiler, const char * entry_point, StackAllocator inner ) :
+        inner_( std::move( inner ) ), profiler_( &profiler ), entry_point_( entry_point ) {
+    }
+
+    stack_context allocate() {
+        stack_context sctx = inner_.allocate();
+        profiler_->begin( sctx, entry_point_ );
+        return sctx;
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        profiler_->end( sctx );
+        inner_.deallocate( sctx );
+    }
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <boost/coroutine2/all.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "reserved_stack.hpp"
+
+struct stack_reclaimer_stats {
+    std::uint64_t passes = 0;
+    std::uint64_t stacks = 0;           // stacks looked at, over all passes
+    std::uint64_t reclaimed = 0;        // stacks that had pages released
+    std::uint64_t released_pages = 0;   // pages handed back, resident or not
+    double        busy_s = 0;           // time spent in passes
+};
+
+// Trims parked stacks from a thread of its own, so coroutines can suspend without calling StackShrink on
+// their way out. A pass every period releases everything below the page under parked_sp (see StackPark), like
+// StackShrink would have, of every stack that has been parked for longer than idle and ran since it was last
+// trimmed. madvise works on any thread of the process, so nothing has to run on the stack itself.
+//
+// Stacks must never be trimmed while they run: whoever resumes a coroutine brackets the resume with
+// StackBeginResume and StackEndResume, and the reclaimer only takes stacks it can move from stack_parked to
+// stack_reclaiming, one at a time, handing each back right after its madvise. A resume that hits a stack in
+// the middle of that waits for the one madvise. reclaimable_coroutine does the bracketing, reclaimed_stack
+// registers the stacks. Linux only, it relies on the stack_header.
+//
+// A period of clock_type::duration::max() runs no passes of its own, only the ones asked for with
+// reclaim_now, for a reclaimer that memory pressure drives (stack_pressure.hpp).
+class stack_reclaimer_t {
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    explicit stack_reclaimer_t( clock_type::duration idle, clock_type::duration period = clock_type::duration::zero() ) :
+        idle_( idle ), period_( period != clock_type::duration::zero() ? period : std::max( idle / 2, clock_type::duration( 1 ) ) ) {
+        thread_ = std::thread( [this] { run(); } );
+    }
+
+    ~stack_reclaimer_t() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    stack_reclaimer_t( const stack_reclaimer_t & ) = delete;
+    stack_reclaimer_t & operator=( const stack_reclaimer_t & ) = delete;
+
+    // The stack has to be fresh from its allocator, pools reset a recycled one (ResetStackHeader).
+    void add( stack_header * hdr ) {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        stacks_.push_back( hdr );
+    }
+
+    // After this the reclaimer does not touch the stack any more, it may be released.
+    void remove( stack_header * hdr ) {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            auto it = std::find( stacks_.begin(), stacks_.end(), hdr );
+            BOOST_ASSERT( it != stacks_.end() );
+            *it = stacks_.back();
+            stacks_.pop_back();
+        }
+        // it may have been claimed right before it left the list
+        while ( hdr->state.load( std::memory_order_acquire ) == stack_reclaiming ) {
+            std::this_thread::yield();
+        }
+    }
+
+    stack_reclaimer_stats stats() const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return stats_;
+    }
+
+    clock_type::duration idle() const { return idle_; }
+
+    // Run a pass on the calling thread right now, over the stacks parked for longer than idle, zero for all of
+    // them, releasing with how. Passes with anything but dontneed leave the stacks to the next pass, which may
+    // be a stronger one. Returns the pages released, resident or not.
+    std::uint64_t reclaim_now( clock_type::duration idle, stack_release how = stack_release::dontneed ) {
+        std::vector< stack_header * > claimed;
+        std::unique_lock< std::mutex > lock( mutex_ );
+        return pass( lock, claimed, idle, how );
+    }
+
+private:
+    void run() {
+        std::vector< stack_header * > claimed;
+        std::unique_lock< std::mutex > lock( mutex_ );
+        for ( ;; ) {
+            if ( period_ == clock_type::duration::max() ) {
+                wake_.wait( lock, [this] { return stop_; } );
+            } else {
+                wake_.wait_for( lock, period_, [this] { return stop_; } );
+            }
+            if ( stop_ ) {
+                break;
+            }
+            pass( lock, claimed, idle_, stack_release::dontneed );
+        }
+    }
+
+    // called and returns with lock held, drops it while releasing
+    std::uint64_t pass( std::unique_lock< std::mutex > & lock, std::vector< stack_header * > & claimed,
+                        clock_type::duration idle, stack_release how ) {
+        auto start = clock_type::now();
+        const std::int64_t idle_since = (start - idle).time_since_epoch().count();
+        claimed.clear();
+        for ( stack_header * hdr : stacks_ ) {
+            if ( !hdr->parked_sp.load( std::memory_order_acquire )
+                 || hdr->last_resume.load( std::memory_order_relaxed ) > idle_since
+                 || (hdr->released_end && hdr->parks.load( std::memory_order_acquire ) == hdr->shrunk_parks) ) {
+                continue;
+            }
+            std::uint32_t expected = stack_parked;
+            if ( hdr->state.compare_exchange_strong( expected, stack_reclaiming, std::memory_order_acquire ) ) {
+                claimed.push_back( hdr );
+            }
+        }
+        stats_.stacks += stacks_.size();
+        lock.unlock();
+
+        // the claimed stacks can neither run nor be removed until they are handed back
+        std::uint64_t pages = 0;
+        for ( stack_header * hdr : claimed ) {
+            pages += reclaim( hdr, how );
+            hdr->state.store( stack_parked, std::memory_order_release );
+        }
+
+        lock.lock();
+        ++stats_.passes;
+        stats_.reclaimed += claimed.size();
+        stats_.released_pages += pages;
+        stats_.busy_s += std::chrono::duration< double >( clock_type::now() - start ).count();
+        return pages;
+    }
+
+    // Same bounds as StackShrink, keep the page the coroutine parked in and the one below for the switch.
+    static std::uint64_t reclaim( stack_header * hdr, stack_release how ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        PBYTE sp = hdr->parked_sp.load( std::memory_order_relaxed );
+        if ( !sp ) {
+            // resumed after the pass looked at it, and suspended again without parking
+            return 0;
+        }
+        PBYTE pEnd = sp - ((uintptr_t)sp & (page_size - 1)) - page_size;
+        PBYTE pBegin = hdr->usable();
+        if ( PBYTE pCommitted = hdr->committed.load( std::memory_order_relaxed ) ) {
+            // fault grown stacks keep their protection, the pages just come back zero filled
+            pBegin = pCommitted;
+        }
+        if ( how == stack_release::dontneed ) {
+            hdr->shrunk_parks = hdr->parks.load( std::memory_order_relaxed );
+            hdr->released_end = std::max( pBegin, pEnd );
+        }
+        if ( pEnd <= pBegin ) {
+            return 0;
+        }
+        if ( hdr->release_hook ) {
+            hdr->release_hook( *hdr, pBegin, pEnd );
+        }
+        ReleaseStackPages( *hdr, pBegin, pEnd, how );
+        return (pEnd - pBegin) / page_size;
+    }
+
+    const clock_type::duration      idle_;
+    const clock_type::duration      period_;
+    mutable std::mutex              mutex_;
+    std::condition_variable         wake_;
+    bool                            stop_ = false;
+    std::vector< stack_header * >   stacks_;
+    stack_reclaimer_stats           stats_;
+    std::thread                     thread_;
+};
+
+// StackAllocator that registers the stacks of another one with a stack_reclaimer_t for as long as they are
+// handed out. The inner allocator has to be one of ours, the reclaimer works off the stack_header.
+template< typename StackAllocator >
+class reclaimed_stack {
+private:
+    StackAllocator          inner_;
+    stack_reclaimer_t *     reclaimer_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    reclaimed_stack( stack_reclaimer_t & reclaimer, StackAllocator inner ) :
+        inner_( std::move( inner ) ), reclaimer_( &reclaimer ) {
+    }
+
+    stack_context allocate() {
+        stack_context sctx = inner_.allocate();
+        auto hdr = static_cast< stack_header * >(sctx.sp);
+        reclaimer_->add( hdr );
+        last_allocated_ = hdr;
+        return sctx;
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        reclaimer_->remove( static_cast< stack_header * >(sctx.sp) );
+        inner_.deallocate( sctx );
+    }
+
+    // The stack this thread allocated last, for reclaimable_coroutine to pick up its header.
+    static stack_header * last_allocated() { return last_allocated_; }
+
+private:
+    static inline thread_local stack_header * last_allocated_ = nullptr;
+};
+
+// A push coroutine on a reclaimed_stack, every resume bracketed with StackBeginResume and StackEndResume. The
+// coroutine body parks with StackPark() right before it suspends, anything it does not park is left alone.
+// Destroying it while it is suspended resumes it one last time to unwind, which is bracketed too.
+class reclaimable_coroutine {
+public:
+    typedef boost::coroutines2::coroutine< void > co_type;
+
+    template< typename StackAllocator, typename Fn >
+    reclaimable_coroutine( reclaimed_stack< StackAllocator > stack, Fn && fn ) :
+        co_( std::move( stack ), std::forward< Fn >( fn ) ), hdr_( reclaimed_stack< StackAllocator >::last_allocated() ) {
+    }
+
+    reclaimable_coroutine( reclaimable_coroutine && other ) BOOST_NOEXCEPT_OR_NOTHROW :
+        co_( std::move( other.co_ ) ), hdr_( std::exchange( other.hdr_, nullptr ) ) {
+    }
+
+    reclaimable_coroutine & operator=( reclaimable_coroutine && other ) BOOST_NOEXCEPT_OR_NOTHROW {
+        if ( this != &other ) {
+            if ( hdr_ ) {
+                StackBeginResume( hdr_ );
+            }
+            co_ = std::move( other.co_ );
+            hdr_ = std::exchange( other.hdr_, nullptr );
+        }
+        return *this;
+    }
+
+    ~reclaimable_coroutine() {
+        if ( hdr_ ) {
+            StackBeginResume( hdr_ );
+        }
+    }
+
+    void operator()() {
+        StackBeginResume( hdr_ );
+        StackTrace( trace_event::resume, hdr_->base );
+        co_();
+        StackTrace( trace_event::suspend, hdr_->base );
+        // a finished one stays running, there is nothing left to trim
+        if ( co_ ) {
+            StackEndResume( hdr_ );
+        }
+    }
+
+    explicit operator bool() const BOOST_NOEXCEPT_OR_NOTHROW { return static_cast< bool >( co_ ); }
+
+private:
+    co_type::push_type  co_;
+    stack_header *      hdr_;
+};
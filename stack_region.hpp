@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+
+#include "stack_header.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+enum class stack_region_state {
+    reserved,   // address space only, nothing resident
+    committed,  // backed by memory
+    guard,      // traps on access
+};
+
+// One contiguous run of pages of a stack reservation that share state and protection. Filled by
+// QueryStackRegions into a caller supplied array so it can run at every suspend point without allocating.
+struct stack_region_info {
+    PBYTE               begin;
+    PBYTE               end;
+    stack_region_state  state;
+    DWORD               protect;        // PAGE_* on Windows, PROT_* on Linux
+    std::size_t         resident_pages;
+};
+
+// Enough for the guard, committed and reserved runs of a stack that has been shrunk a few times.
+constexpr std::size_t max_stack_regions = 64;
+
+#ifdef _WIN32
+
+inline std::size_t RegionPageSize() {
+    static const std::size_t page_size = [] {
+        SYSTEM_INFO stSysInfo;
+        GetSystemInfo( &stSysInfo );
+        return (std::size_t)stSysInfo.dwPageSize;
+    }();
+    return page_size;
+}
+
+// Fill regions with up to max_regions runs of the reservation pPtr lives in, returns the number of runs
+// the reservation has, which may be larger than max_regions.
+inline std::size_t QueryStackRegions( const void * pPtr, stack_region_info * regions, std::size_t max_regions ) {
+    const auto page_size = RegionPageSize();
+
+    // Get the stack last page.
+    MEMORY_BASIC_INFORMATION stMemBasicInfo;
+    if ( !VirtualQuery( pPtr, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) ) {
+        return 0;
+    }
+    const PVOID pAllocationBase = stMemBasicInfo.AllocationBase;
+
+    std::size_t count = 0;
+    PBYTE pPos = (PBYTE)pAllocationBase;
+    while ( VirtualQuery( pPos, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) && stMemBasicInfo.AllocationBase == pAllocationBase ) {
+        if ( count < max_regions ) {
+            auto & region = regions[count];
+            region.begin = pPos;
+            region.end = pPos + stMemBasicInfo.RegionSize;
+            region.protect = stMemBasicInfo.Protect;
+            // committed pages are charged to the working set once touched, treat them as resident
+            region.resident_pages = 0;
+            if ( stMemBasicInfo.State != MEM_COMMIT ) {
+                region.state = stack_region_state::reserved;
+            } else if ( stMemBasicInfo.Protect & PAGE_GUARD ) {
+                region.state = stack_region_state::guard;
+            } else {
+                region.state = stack_region_state::committed;
+                region.resident_pages = stMemBasicInfo.RegionSize / page_size;
+            }
+        }
+        ++count;
+        pPos += stMemBasicInfo.RegionSize;
+    }
+    return count;
+}
+
+#else
+
+inline std::size_t RegionPageSize() {
+    return boost::context::stack_traits::page_size();
+}
+
+// Fill regions with up to max_regions runs of the stack hdr describes, returns the number of runs
+// the stack has, which may be larger than max_regions. Residency comes from mincore.
+inline std::size_t QueryStackRegions( const stack_header * hdr, stack_region_info * regions, std::size_t max_regions ) {
+    const auto page_size = RegionPageSize();
+    std::size_t count = 0;
+
+    auto push = [&]( PBYTE begin, PBYTE end, stack_region_state state, DWORD protect, std::size_t resident ) {
+        if ( count < max_regions ) {
+            regions[count] = stack_region_info{ begin, end, state, protect, resident };
+        }
+        ++count;
+    };
+
+    if ( hdr->guard_size ) {
+        push( hdr->base, hdr->usable(), stack_region_state::guard, PROT_NONE, 0 );
+    }
+    PBYTE pAccessible = hdr->usable();
+    if ( PBYTE pCommitted = hdr->committed.load( std::memory_order_relaxed ) ) {
+        if ( pAccessible < pCommitted ) {
+            push( pAccessible, pCommitted, stack_region_state::reserved, PROT_NONE, 0 );
+        }
+        pAccessible = pCommitted;
+    }
+
+    // walk the accessible part in chunks so the residency vector can live on our own stack
+    constexpr std::size_t chunk_pages = 256;
+    unsigned char vec[chunk_pages];
+    PBYTE pRun = pAccessible;
+    bool run_resident = false;
+    for ( PBYTE pPos = pAccessible; pPos < hdr->top(); ) {
+        const std::size_t pages = std::min< std::size_t >( chunk_pages, (hdr->top() - pPos) / page_size );
+        if ( 0 != ::mincore( pPos, pages * page_size, vec ) ) {
+            break;
+        }
+        for ( std::size_t i = 0; i < pages; ++i, pPos += page_size ) {
+            const bool resident = vec[i] & 1;
+            if ( resident != run_resident && pPos != pRun ) {
+                push( pRun, pPos, run_resident ? stack_region_state::committed : stack_region_state::reserved,
+                      PROT_READ | PROT_WRITE, run_resident ? (pPos - pRun) / page_size : 0 );
+                pRun = pPos;
+            }
+            run_resident = resident;
+        }
+    }
+    if ( pRun != hdr->top() ) {
+        push( pRun, hdr->top(), run_resident ? stack_region_state::committed : stack_region_state::reserved,
+              PROT_READ | PROT_WRITE, run_resident ? (hdr->top() - pRun) / page_size : 0 );
+    }
+    return count;
+}
+
+// Same for the stack pPtr lives in, pPtr must be the live stack pointer or above it.
+inline std::size_t QueryStackRegions( const void * pPtr, stack_region_info * regions, std::size_t max_regions ) {
+    const stack_header * hdr = find_stack_header( pPtr );
+    if ( !hdr ) {
+        return 0;
+    }
+    return QueryStackRegions( hdr, regions, max_regions );
+}
+
+#endif
+
+template< typename T >
+struct hex_fmt_t {
+    hex_fmt_t( T x ) : val( x ) {}
+    friend std::ostream& operator<<( std::ostream& os, const hex_fmt_t & v ) {
+        return os  << std::hex
+                   << std::internal
+                   << std::showbase
+                   << std::setw(8)
+                   << std::setfill( '0' )
+                   << v.val;
+    }
+    T val;
+};
+
+template< typename T >
+hex_fmt_t<T> fmt_hex( T x ) {
+    return hex_fmt_t<T>{ x };
+}
+
+inline const char * fmt_state( stack_region_state state ) {
+    switch ( state ) {
+        case stack_region_state::committed: return "COMMIT ";
+        case stack_region_state::reserved: return "RESERVE";
+        case stack_region_state::guard: return "GUARD  ";
+        default: return "unknown";
+    }
+}
+
+inline void PrintStackRegions( std::ostream & os, const stack_region_info * regions, std::size_t count ) {
+    const auto page_size = RegionPageSize();
+
+    os << "### Stack Dump Start\n";
+    for ( std::size_t i = 0; i < count; ++i ) {
+        const auto & region = regions[i];
+        os << "### Range: " << fmt_hex( (std::uintptr_t)region.begin )
+           << " - " << fmt_hex( (std::uintptr_t)region.end )
+           << " Protect = " << fmt_hex( region.protect )
+           << " State = " << fmt_state( region.state )
+           << std::dec
+           << " Pages = " << (region.end - region.begin) / page_size
+           << " Resident = " << region.resident_pages
+           << '\n';
+    }
+    os << "### Stack Dump Finish" << std::endl;
+}
+
+inline void DbgDumpStack( PBYTE pPtr ) {
+    stack_region_info regions[max_stack_regions];
+    std::size_t count = QueryStackRegions( pPtr, regions, max_stack_regions );
+    PrintStackRegions( std::cout, regions, (std::min)( count, max_stack_regions ) );
+}
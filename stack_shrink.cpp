@@ -7,6 +7,7 @@
 #include <intrin.h>
 #include <iostream>
 #include <iomanip>
+#include "stack_region.hpp"
 
 DWORD g_dwProcessorPageSize;
 
@@ -16,75 +17,13 @@ DWORD g_dwProcessorPageSize;
 #define VERIFY( x ) assert(x)
 #endif
 
-template< typename T >
-struct hex_fmt_t {
-    hex_fmt_t( T x ) : val( x ) {}
-    friend std::ostream& operator<<( std::ostream& os, const hex_fmt_t & v ) {
-        return os  << std::hex
-                   << std::internal
-                   << std::showbase
-                   << std::setw(8)
-                   << std::setfill( '0' )
-                   << v.val;
-    }
-    T val;
-};
-
-template< typename T >
-hex_fmt_t<T> fmt_hex( T x ) {
-    return hex_fmt_t<T>{ x };
-}
-
 __declspec(noinline) PBYTE GetStackPointer() {
     return (PBYTE)_AddressOfReturnAddress() + 8;
 }
 
-const char * fmt_state( DWORD state ) {
-    switch ( state ) {
-        case MEM_COMMIT: return "COMMIT ";
-        case MEM_FREE: return "FREE   ";
-        case MEM_RESERVE: return "RESERVE";
-        default: return "unknown";
-    }
-}
-
-const char * fmt_type( DWORD state ) {
-    switch ( state ) {
-    case MEM_IMAGE: return "IMAGE ";
-    case MEM_MAPPED: return "FMAPPED   ";
-    case MEM_PRIVATE: return "PRIVATE";
-    default: return "unknown";
-    }
-}
-
 void DbgDumpStack()
 {
-//#ifdef _DEBUG
-    std::cout << "### Stack Dump Start\n";
-    PBYTE pPtr = GetStackPointer();
-    
-    // Get the stack last page.
-    MEMORY_BASIC_INFORMATION stMemBasicInfo;
-    VERIFY( VirtualQuery( pPtr, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
-    PBYTE pPos = (PBYTE)stMemBasicInfo.AllocationBase;
-    do
-    {
-        VERIFY( VirtualQuery( pPos, &stMemBasicInfo, sizeof( stMemBasicInfo ) ) );
-        VERIFY( stMemBasicInfo.RegionSize );
-
-        std::cout << "### Range: " << fmt_hex( (SIZE_T)pPos )
-                  << " - " << fmt_hex( (SIZE_T)pPos + stMemBasicInfo.RegionSize )
-                  << " Protect = " << fmt_hex( stMemBasicInfo.Protect )
-                  << " State = " << fmt_state( stMemBasicInfo.State )
-                  << " Type = " << fmt_type( stMemBasicInfo.Type )
-                  << std::dec
-                  << " Pages = " << stMemBasicInfo.RegionSize / g_dwProcessorPageSize
-                  << std::endl;
-
-        pPos += stMemBasicInfo.RegionSize;
-    } while ( pPos < pPtr );
-    std::cout << "### Stack Dump Finish" << std::endl;
-//#endif // _DEBUG
+    DbgDumpStack( GetStackPointer() );
 }
 
 void StackShrink()
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined( _MSC_VER ) && (defined( _M_X64 ) || defined( _M_IX86 ))
+#include <intrin.h>
+#define STACK_TRACE_RDTSC 1
+#elif defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#define STACK_TRACE_RDTSC 1
+#endif
+
+// What happened to a stack. The ids end up in the dump files, append only.
+enum class trace_event : std::uint8_t {
+    allocate,   // a stack was handed out
+    commit,     // pages committed ahead of use, pages = how many
+    shrink,     // pages released below the stack pointer, pages = how many
+    guard_hit,  // the stack grew into pages a fault handler had to provide, pages = how many it committed
+    resume,     // the coroutine on the stack starts running on this thread
+    suspend,    // and stops again
+};
+
+struct trace_record {
+    std::uint64_t   tsc;        // TraceTimestamp()
+    std::uint64_t   stack;      // start of the stack's reservation, the same for every event of one stack
+    std::uint32_t   pages;
+    trace_event     event;
+    std::uint8_t    unused[3];
+};
+
+static_assert( sizeof( trace_record ) == 24, "trace_record is written to dump files as it is" );
+
+// Time stamp counter where there is one, steady clock nanoseconds elsewhere. Only differences mean anything,
+// the dump carries how many of them make a microsecond.
+inline std::uint64_t TraceTimestamp() {
+#ifdef STACK_TRACE_RDTSC
+    return __rdtsc();
+#else
+    return (std::uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Trace events of one thread. Only that thread writes, a reader copies out what is there without stopping
+// it: the writer publishes every record with a release store of head, the reader copies, reads head again
+// and throws away whatever the writer may have overwritten in the meantime. Once full the oldest records go.
+class trace_ring {
+public:
+    trace_ring( std::size_t capacity, std::uint32_t thread_id ) :
+        records_( new trace_record[capacity] ), mask_( capacity - 1 ), thread_id_( thread_id ) {
+        // a power of two, so that wrapping is a mask
+        BOOST_ASSERT( capacity && !(capacity & (capacity - 1)) );
+    }
+
+    trace_ring( const trace_ring & ) = delete;
+    trace_ring & operator=( const trace_ring & ) = delete;
+
+    void push( trace_event event, std::uint64_t stack, std::uint32_t pages ) {
+        const std::uint64_t head = head_.load( std::memory_order_relaxed );
+        trace_record & r = records_[head & mask_];
+        r.tsc = TraceTimestamp();
+        r.stack = stack;
+        r.pages = pages;
+        r.event = event;
+        head_.store( head + 1, std::memory_order_release );
+    }
+
+    // The records still in the ring, oldest first.
+    std::vector< trace_record > snapshot() const {
+        const std::uint64_t capacity = mask_ + 1;
+        const std::uint64_t head = head_.load( std::memory_order_acquire );
+        std::uint64_t begin = head > capacity ? head - capacity : 0;
+        std::vector< trace_record > out( head - begin );
+        for ( std::uint64_t i = begin; i < head; ++i ) {
+            std::memcpy( &out[i - begin], &records_[i & mask_], sizeof( trace_record ) );
+        }
+        std::atomic_thread_fence( std::memory_order_acquire );
+        const std::uint64_t after = head_.load( std::memory_order_relaxed );
+        // the writer went round and may have overwritten the front while we copied it, and may be writing
+        // record after right now, into the slot of record after - capacity
+        if ( after + 1 > capacity && after + 1 - capacity > begin ) {
+            out.erase( out.begin(), out.begin() + std::min< std::uint64_t >( after + 1 - capacity - begin, out.size() ) );
+        }
+        return out;
+    }
+
+    std::uint32_t thread_id() const { return thread_id_; }
+    std::uint64_t written() const { return head_.load( std::memory_order_relaxed ); }
+
+private:
+    std::unique_ptr< trace_record[] >   records_;
+    const std::uint64_t                 mask_;
+    const std::uint32_t                 thread_id_;
+    std::atomic< std::uint64_t >        head_{ 0 };
+};
+
+namespace stack_trace_detail {
+
+inline std::atomic< bool >                          enabled{ false };
+inline std::mutex                                   mutex;
+inline std::size_t                                  ring_records = 1 << 16;
+inline std::vector< std::shared_ptr< trace_ring > > rings;      // kept after their thread exits, for the dump
+inline std::uint64_t                                start_tsc = 0;
+inline std::chrono::steady_clock::time_point        start_time;
+inline std::atomic< std::uint32_t >                 generation{ 0 };    // bumped by every StackTraceStart
+
+// constant initialized, so reading them from a signal handler is fine. A ring of an earlier trace is gone.
+inline thread_local trace_ring *                    ring = nullptr;
+inline thread_local std::uint32_t                   ring_generation = 0;
+
+inline trace_ring * CurrentRing() {
+    return ring && ring_generation == generation.load( std::memory_order_relaxed ) ? ring : nullptr;
+}
+
+inline trace_ring * CreateRing() {
+    std::lock_guard< std::mutex > lock( mutex );
+    rings.push_back( std::make_shared< trace_ring >( ring_records, (std::uint32_t)rings.size() + 1 ) );
+    ring = rings.back().get();
+    ring_generation = generation.load( std::memory_order_relaxed );
+    return ring;
+}
+
+}
+
+// Start tracing, each thread gets a ring of records records (24 bytes each, rounded up to a power of two) with
+// its first event. Rings of an earlier trace are dropped, so no thread may be tracing while this runs.
+inline void StackTraceStart( std::size_t records = 1 << 16 ) {
+    using namespace stack_trace_detail;
+    std::lock_guard< std::mutex > lock( mutex );
+    rings.clear();
+    ring_records = 2;
+    while ( ring_records < records ) {
+        ring_records <<= 1;
+    }
+    generation.fetch_add( 1, std::memory_order_relaxed );
+    start_tsc = TraceTimestamp();
+    start_time = std::chrono::steady_clock::now();
+    enabled.store( true, std::memory_order_relaxed );
+}
+
+// Threads see this a little late, a few more events may still come in.
+inline void StackTraceStop() {
+    stack_trace_detail::enabled.store( false, std::memory_order_relaxed );
+}
+
+// Record event for the stack whose reservation starts at stack. Costs a relaxed load while tracing is off,
+// and a time stamp plus a store of 24 bytes while it is on. The first event of a thread allocates its ring.
+inline void StackTrace( trace_event event, const void * stack, std::size_t pages = 0 ) {
+    using namespace stack_trace_detail;
+    if ( !enabled.load( std::memory_order_relaxed ) ) {
+        return;
+    }
+    trace_ring * r = CurrentRing();
+    if ( !r ) {
+        r = CreateRing();
+    }
+    r->push( event, (std::uint64_t)(std::uintptr_t)stack, (std::uint32_t)pages );
+}
+
+// StackTrace for signal handlers, which must not allocate: a thread without a ring yet drops the event.
+inline void StackTraceNoAlloc( trace_event event, const void * stack, std::size_t pages = 0 ) {
+    using namespace stack_trace_detail;
+    trace_ring * r = enabled.load( std::memory_order_relaxed ) ? CurrentRing() : nullptr;
+    if ( r ) {
+        r->push( event, (std::uint64_t)(std::uintptr_t)stack, (std::uint32_t)pages );
+    }
+}
+
+// Dump file layout, all little endian as the machine writes it: the header, then for every ring its
+// trace_ring_header and count trace_records, oldest first.
+struct trace_file_header {
+    static constexpr std::uint64_t magic_value = 0x3130435254534b53ULL;    // "SKSTRC01"
+
+    std::uint64_t   magic;
+    double          ticks_per_us;       // TraceTimestamp ticks
+    std::uint64_t   start_tsc;          // taken by StackTraceStart
+    std::uint32_t   rings;
+    std::uint32_t   record_size;
+};
+
+struct trace_ring_header {
+    std::uint32_t   thread_id;          // in the order the threads first traced, from 1
+    std::uint32_t   unused;
+    std::uint64_t   count;
+    std::uint64_t   dropped;            // records the ring had to overwrite
+};
+
+// Write every ring to out. Safe while the threads keep tracing, what they write meanwhile may or may not
+// make it in. Ticks are calibrated against the steady clock over the time since StackTraceStart.
+inline void StackTraceDump( std::ostream & out ) {
+    using namespace stack_trace_detail;
+    std::vector< std::shared_ptr< trace_ring > > dump;
+    trace_file_header header = {};
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        dump = rings;
+        header.start_tsc = start_tsc;
+        const double us = std::chrono::duration< double, std::micro >( std::chrono::steady_clock::now() - start_time ).count();
+        header.ticks_per_us = us > 0 ? (double)(TraceTimestamp() - start_tsc) / us : 1.0;
+    }
+    header.magic = trace_file_header::magic_value;
+    header.rings = (std::uint32_t)dump.size();
+    header.record_size = sizeof( trace_record );
+    out.write( (const char *)&header, sizeof( header ) );
+    for ( auto & ring : dump ) {
+        const std::uint64_t written = ring->written();
+        std::vector< trace_record > records = ring->snapshot();
+        trace_ring_header rh = {};
+        rh.thread_id = ring->thread_id();
+        rh.count = records.size();
+        rh.dropped = written > records.size() ? written - records.size() : 0;
+        out.write( (const char *)&rh, sizeof( rh ) );
+        out.write( (const char *)records.data(), records.size() * sizeof( trace_record ) );
+    }
+}
+
+inline const char * TraceEventName( trace_event event ) {
+    switch ( event ) {
+    case trace_event::allocate:  return "allocate";
+    case trace_event::commit:    return "commit";
+    case trace_event::shrink:    return "shrink";
+    case trace_event::guard_hit: return "guard_hit";
+    case trace_event::resume:    return "resume";
+    case trace_event::suspend:   return "suspend";
+    }
+    return "unknown";
+}
+
+// Convert a dump to the Chrome trace event format (chrome://tracing, Perfetto). Every thread is a track, a
+// resume to the next suspend on it is a slice named after the stack, the other events are instants carrying
+// the stack and the pages. False if in is not a dump.
+inline bool StackTraceToChrome( std::istream & in, std::ostream & out ) {
+    trace_file_header header;
+    if ( !in.read( (char *)&header, sizeof( header ) ) || header.magic != trace_file_header::magic_value
+         || header.record_size != sizeof( trace_record ) || !(header.ticks_per_us > 0) ) {
+        return false;
+    }
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const char * sep = "\n";
+    char stack[32];
+    for ( std::uint32_t i = 0; i < header.rings; ++i ) {
+        trace_ring_header rh;
+        if ( !in.read( (char *)&rh, sizeof( rh ) ) ) {
+            return false;
+        }
+        out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << rh.thread_id
+            << ",\"args\":{\"name\":\"thread " << rh.thread_id << (rh.dropped ? " (wrapped)" : "") << "\"}}";
+        sep = ",\n";
+        for ( std::uint64_t n = 0; n < rh.count; ++n ) {
+            trace_record r;
+            if ( !in.read( (char *)&r, sizeof( r ) ) ) {
+                return false;
+            }
+            const double ts = (double)(std::int64_t)(r.tsc - header.start_tsc) / header.ticks_per_us;
+            std::snprintf( stack, sizeof( stack ), "0x%llx", (unsigned long long)r.stack );
+            out << sep << "{\"pid\":1,\"tid\":" << rh.thread_id << ",\"ts\":" << std::fixed << ts;
+            switch ( r.event ) {
+            case trace_event::resume:
+                out << ",\"ph\":\"B\",\"name\":\"stack " << stack << "\"}";
+                break;
+            case trace_event::suspend:
+                out << ",\"ph\":\"E\"}";
+                break;
+            default:
+                out << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << TraceEventName( r.event )
+                    << "\",\"args\":{\"stack\":\"" << stack << "\",\"pages\":" << r.pages << "}}";
+                break;
+            }
+        }
+    }
+    out << "\n]}" << std::endl;
+    return true;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/coroutine2/all.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "pooled_stack.hpp"
+
+struct think_worker_stats {
+    std::uint64_t resumes = 0;          // coroutines resumed by this worker
+    std::uint64_t steals = 0;           // successful steals from another worker's deque
+    std::uint64_t stolen = 0;           // coroutines taken over by those steals
+    std::uint64_t failed_steals = 0;    // victims that turned out to be empty
+    std::uint64_t finished = 0;         // coroutines that ran to completion on this worker
+    stack_pool_stats pool;              // this worker's stack pool
+};
+
+// Resumes think coroutines on a set of worker threads. Every worker owns a deque of the coroutines it is
+// going to resume in the current round: it works from the back of its own, and once that is empty it steals
+// the older half of some other worker's deque from the front. A coroutine that suspends stays with whoever
+// resumed it for the next round, so coroutines migrate between threads over time.
+//
+// Stacks come from per-worker stack_pool_t instances and are released into the pool of the worker the
+// coroutine finishes on, so the pools never see another thread. StackShrink and StackTrim only look at the
+// stack they are given, migration does not change anything for them. Think functions must not keep
+// thread_local state, or anything else tied to a thread, across a suspend.
+class think_scheduler_t {
+public:
+    typedef boost::coroutines2::coroutine< void > think_co;
+
+    think_scheduler_t( std::size_t num_workers, std::size_t stack_size ) {
+        if ( !num_workers ) {
+            num_workers = (std::max)( 1u, std::thread::hardware_concurrency() );
+        }
+        for ( std::size_t i = 0; i < num_workers; ++i ) {
+            workers_.emplace_back( new worker( this, i, stack_size ) );
+        }
+        for ( auto & w : workers_ ) {
+            worker * pw = w.get();
+            w->thread = std::thread( [this, pw] { work( *pw ); } );
+        }
+    }
+
+    ~think_scheduler_t() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        start_.notify_all();
+        for ( auto & w : workers_ ) {
+            w->thread.join();
+        }
+        // the workers are gone, release what is left into the pools the stacks came from
+        for ( auto & w : workers_ ) {
+            w->ready.clear();
+            w->next.clear();
+        }
+    }
+
+    think_scheduler_t( const think_scheduler_t & ) = delete;
+    think_scheduler_t & operator=( const think_scheduler_t & ) = delete;
+
+    // Add a coroutine, spread round robin over the workers. Only between rounds, fn is
+    // void( think_co::pull_type & ) and starts running on its first resume.
+    template< typename Fn >
+    void spawn( Fn && fn ) {
+        worker & w = *workers_[next_spawn_++ % workers_.size()];
+        w.next.emplace_back( scheduler_stack{ this, w.index }, std::forward< Fn >( fn ) );
+        ++live_;
+    }
+
+    // Resume every live coroutine once, spread over all workers, and return when they have all suspended
+    // again or finished. Rethrows the first exception a coroutine let out.
+    void run_round() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            for ( auto & w : workers_ ) {
+                BOOST_ASSERT( w->ready.empty() );
+                w->ready.swap( w->next );
+            }
+            remaining_.store( live_, std::memory_order_relaxed );
+            idle_workers_ = 0;
+            ++round_;
+        }
+        start_.notify_all();
+
+        std::unique_lock< std::mutex > lock( mutex_ );
+        done_.wait( lock, [this] { return idle_workers_ == workers_.size(); } );
+        for ( auto & w : workers_ ) {
+            live_ -= w->round_finished;
+            w->round_finished = 0;
+        }
+        if ( error_ ) {
+            std::exception_ptr e = error_;
+            error_ = nullptr;
+            std::rethrow_exception( e );
+        }
+    }
+
+    std::size_t live() const { return live_; }
+    std::size_t num_workers() const { return workers_.size(); }
+
+    // Only between rounds.
+    think_worker_stats worker_stats( std::size_t index ) const {
+        const worker & w = *workers_[index];
+        think_worker_stats s = w.stats;
+        s.pool = w.pool.stats();
+        return s;
+    }
+
+private:
+    struct worker;
+
+    // StackAllocator handing out stacks from the pool of the worker a coroutine is spawned on, and taking
+    // them back into the pool of the worker it finishes on.
+    class scheduler_stack {
+    public:
+        typedef boost::context::stack_traits traits_type;
+        typedef boost::context::stack_context stack_context;
+
+        scheduler_stack( think_scheduler_t * scheduler, std::size_t home ) BOOST_NOEXCEPT_OR_NOTHROW :
+            scheduler_( scheduler ), home_( home ) {
+        }
+
+        stack_context allocate() {
+            return scheduler_->workers_[home_]->pool.allocate();
+        }
+
+        void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+            BOOST_ASSERT( sctx.sp );
+            worker * w = current_worker_;
+            if ( !w || w->scheduler != scheduler_ ) {
+                w = scheduler_->workers_[home_].get();
+            }
+            w->pool.deallocate( sctx );
+        }
+
+    private:
+        think_scheduler_t * scheduler_;
+        std::size_t         home_;
+    };
+
+    struct alignas( 64 ) worker {
+        worker( think_scheduler_t * s, std::size_t i, std::size_t stack_size ) :
+            scheduler( s ), index( i ), pool( stack_size ), rng( (unsigned)i + 1 ) {
+        }
+
+        think_scheduler_t *             scheduler;
+        std::size_t                     index;
+        std::mutex                      mutex;      // guards ready against thieves
+        std::deque< think_co::push_type > ready;    // still to be resumed this round
+        std::deque< think_co::push_type > next;     // suspended this round, owner only
+        stack_pool_t                    pool;
+        think_worker_stats              stats;
+        std::size_t                     round_finished = 0;
+        std::minstd_rand                rng;
+        std::thread                     thread;
+    };
+
+    void work( worker & w ) {
+        current_worker_ = &w;
+        std::uint64_t seen_round = 0;
+        for ( ;; ) {
+            {
+                std::unique_lock< std::mutex > lock( mutex_ );
+                start_.wait( lock, [&] { return stop_ || round_ != seen_round; } );
+                if ( stop_ ) {
+                    break;
+                }
+                seen_round = round_;
+            }
+
+            while ( remaining_.load( std::memory_order_acquire ) > 0 ) {
+                std::optional< think_co::push_type > think;
+                if ( !pop( w, think ) && !steal( w, think ) ) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                resume( w, *think );
+            }
+            w.pool.trim();
+
+            {
+                std::lock_guard< std::mutex > lock( mutex_ );
+                ++idle_workers_;
+            }
+            done_.notify_one();
+        }
+        current_worker_ = nullptr;
+    }
+
+    bool pop( worker & w, std::optional< think_co::push_type > & think ) {
+        std::lock_guard< std::mutex > lock( w.mutex );
+        if ( w.ready.empty() ) {
+            return false;
+        }
+        think.emplace( std::move( w.ready.back() ) );
+        w.ready.pop_back();
+        return true;
+    }
+
+    // Take the front half of a random victim's deque, resume the first of them right away.
+    bool steal( worker & w, std::optional< think_co::push_type > & think ) {
+        if ( workers_.size() < 2 ) {
+            return false;
+        }
+        std::size_t victim_index = w.rng() % (workers_.size() - 1);
+        if ( victim_index >= w.index ) {
+            ++victim_index;
+        }
+        worker & victim = *workers_[victim_index];
+
+        std::deque< think_co::push_type > loot;
+        {
+            std::lock_guard< std::mutex > lock( victim.mutex );
+            const std::size_t take = (victim.ready.size() + 1) / 2;
+            for ( std::size_t i = 0; i < take; ++i ) {
+                loot.push_back( std::move( victim.ready.front() ) );
+                victim.ready.pop_front();
+            }
+        }
+        if ( loot.empty() ) {
+            ++w.stats.failed_steals;
+            return false;
+        }
+        ++w.stats.steals;
+        w.stats.stolen += loot.size();
+
+        think.emplace( std::move( loot.front() ) );
+        loot.pop_front();
+        if ( !loot.empty() ) {
+            std::lock_guard< std::mutex > lock( w.mutex );
+            for ( auto & t : loot ) {
+                w.ready.push_front( std::move( t ) );
+            }
+        }
+        return true;
+    }
+
+    void resume( worker & w, think_co::push_type & think ) {
+        try {
+            think();
+        } catch ( ... ) {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            if ( !error_ ) {
+                error_ = std::current_exception();
+            }
+        }
+        ++w.stats.resumes;
+        if ( think ) {
+            w.next.push_back( std::move( think ) );
+        } else {
+            // the caller drops it, its stack goes back into this worker's pool
+            ++w.stats.finished;
+            ++w.round_finished;
+        }
+        remaining_.fetch_sub( 1, std::memory_order_acq_rel );
+    }
+
+    static inline thread_local worker * current_worker_ = nullptr;
+
+    std::vector< std::unique_ptr< worker > >    workers_;
+    std::size_t                                 next_spawn_ = 0;
+    std::size_t                                 live_ = 0;
+    std::atomic< std::size_t >                  remaining_{ 0 };
+
+    std::mutex                                  mutex_;
+    std::condition_variable                     start_;
+    std::condition_variable                     done_;
+    std::uint64_t                               round_ = 0;
+    std::size_t                                 idle_workers_ = 0;
+    bool                                        stop_ = false;
+    std::exception_ptr                          error_;
+};
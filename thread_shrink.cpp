@@ -0,0 +1,64 @@
+// Linux counterpart of stack_shrink.cpp: the same walk over the calling thread's own stack, then a thread
+// pool whose workers shrink their stacks after tasks that went deep.
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <thread>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "thread_stack.hpp"
+
+void Dump( const char * what ) {
+    std::cout << std::left << std::setw( 16 ) << what << std::right << " resident depth "
+              << std::setw( 5 ) << ThreadStackDepth() / 1024 << "KiB, rss " << std::fixed << std::setprecision( 1 )
+              << (double)ProcessResidentBytes() / (1024 * 1024) << "MiB" << std::endl;
+}
+
+void WalkStack( const char * thread ) {
+    std::cout << thread << std::endl;
+    Dump( "  default stack" );
+    StackConsume( 100 * 1024 );
+    Dump( "  100K consumed" );
+    ThreadStackShrink();
+    Dump( "  compacted" );
+    StackConsume( 900 * 1024 );
+    Dump( "  900K consumed" );
+    ThreadStackShrink();
+    Dump( "  compacted" );
+}
+
+// tasks of which every deep_every-th one goes deep, the rest stay shallow
+void RunPool( const char * name, std::size_t shrink_depth, int workers, int tasks, int deep_every, DWORD deep ) {
+    const std::size_t rss = ProcessResidentBytes();
+    shrinking_thread_pool_t pool( workers, shrink_depth );
+    timer time;
+    time.start();
+    for ( int i = 0; i < tasks; ++i ) {
+        const DWORD depth = i % deep_every == 0 ? deep : 16 * 1024;
+        pool.submit( [depth] { StackConsume( depth ); } );
+    }
+    pool.wait();
+    const double elapsed = time.stop();
+    auto stats = pool.stats();
+    std::cout << name << std::fixed << std::setprecision( 1 )
+              << (double)((std::ptrdiff_t)ProcessResidentBytes() - (std::ptrdiff_t)rss) / (1024 * 1024) << "MiB rss, "
+              << stats.shrinks << " shrinks, " << (double)stats.released_bytes / (1024 * 1024) << "MiB released, "
+              << std::setprecision( 2 ) << elapsed * 1e6 / tasks << "us per task" << std::endl;
+}
+
+int main( int argc, char ** argv ) {
+    int workers = argc > 1 ? std::atoi( argv[1] ) : 8;
+    int tasks = argc > 2 ? std::atoi( argv[2] ) : 100'000;
+    int deep_every = argc > 3 ? std::atoi( argv[3] ) : 1000;
+    DWORD deep = argc > 4 ? (DWORD)std::atoi( argv[4] ) * 1024 : 4 * 1024 * 1024;
+
+    WalkStack( "main thread" );
+    std::thread( [] { WalkStack( "pthread" ); } ).join();
+
+    std::cout << workers << " workers, " << tasks << " tasks, every " << deep_every << "th one " << deep / 1024
+              << "KiB deep" << std::endl;
+    RunPool( "  never shrink:       ", (std::size_t)-1, workers, tasks, deep_every, deep );
+    RunPool( "  shrink past 256KiB: ", 256 * 1024, workers, tasks, deep_every, deep );
+    return 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "reserved_stack.hpp"
+
+// Lowest resident page of [lo, hi) of a thread stack, hi if there is none. Unlike LowestResidentPage it steps
+// over the part of the range that is not mapped: the main thread's stack is only mapped from as deep as it
+// ever went up to its top, anything below that is unmapped all the way down to lo.
+inline PBYTE LowestResidentThreadStackPage( PBYTE lo, PBYTE hi ) {
+    const auto page_size = boost::context::stack_traits::page_size();
+    unsigned char vec[1024];
+    std::size_t max_pages = sizeof( vec );
+    while ( lo < hi ) {
+        const std::size_t pages = std::min< std::size_t >( (hi - lo) / page_size, max_pages );
+        if ( 0 != ::mincore( lo, pages * page_size, vec ) ) {
+            // a chunk that ends unmapped is unmapped as a whole, one that straddles the start of the mapping
+            // is split until it does not
+            if ( pages == 1 || 0 != ::mincore( lo + (pages - 1) * page_size, page_size, vec ) ) {
+                lo += pages * page_size;
+            } else {
+                max_pages = pages / 2;
+            }
+            continue;
+        }
+        for ( std::size_t i = 0; i < pages; ++i, lo += page_size ) {
+            if ( vec[i] & 1 ) {
+                return lo;
+            }
+        }
+        max_pages = sizeof( vec );
+    }
+    return hi;
+}
+
+// How deep the calling thread's stack has been resident since it was last shrunk: from the top of the stack
+// down to its lowest resident page. Costs a mincore call per 4 MiB of stack below the caller.
+inline std::size_t ThreadStackDepth() {
+    const thread_stack_bounds & bounds = ThreadStackBounds();
+    BOOST_ASSERT_MSG( bounds.low < bounds.high, "no stack bounds for this thread" );
+    const auto page_size = boost::context::stack_traits::page_size();
+    PBYTE sp = GetStackPointer();
+    PBYTE pCur = sp - ((uintptr_t)sp & (page_size - 1));
+    return bounds.high - LowestResidentThreadStackPage( bounds.low, pCur );
+}
+
+// StackShrink for the stack of the calling thread, which is not a reserved stack with a header but whatever
+// the thread was started on, the main thread's included. Keeps the page the stack pointer is in and one below
+// it, and releases every resident page further down. Returns the bytes released, resident or not.
+inline std::size_t ThreadStackShrink( stack_release how = stack_release::dontneed ) {
+    PBYTE sp = GetStackPointer();
+    const thread_stack_bounds & bounds = ThreadStackBounds();
+    BOOST_ASSERT_MSG( bounds.low < sp && sp <= bounds.high, "ThreadStackShrink called off the thread's stack" );
+    const auto page_size = boost::context::stack_traits::page_size();
+    PBYTE pAllocate = sp - ((uintptr_t)sp & (page_size - 1)) - page_size;
+
+    // starting at the lowest resident page keeps the range inside the mapping
+    PBYTE pLowest = LowestResidentThreadStackPage( bounds.low, pAllocate );
+    if ( pLowest >= pAllocate ) {
+        return 0;
+    }
+    StackTrace( trace_event::shrink, bounds.low, (pAllocate - pLowest) / page_size );
+    ReleasePages( pLowest, pAllocate, how );
+    return pAllocate - pLowest;
+}
+
+struct thread_pool_stats {
+    std::uint64_t tasks = 0;            // tasks run to completion, thrown ones included
+    std::uint64_t shrinks = 0;          // tasks after which the worker's stack was shrunk
+    std::uint64_t released_bytes = 0;   // by those shrinks
+    std::size_t   max_depth = 0;        // deepest stack measured after a task
+};
+
+// A fixed set of worker threads running tasks from a FIFO queue. After every task the worker measures how
+// deep its stack is resident (ThreadStackDepth) and shrinks it back to the worker's own frames once that is
+// more than shrink_depth, so a task that went deep once does not leave megabytes resident for the life of
+// the process. Shallow tasks pay for the measurement only, a few microseconds for an 8 MiB stack.
+class shrinking_thread_pool_t {
+public:
+    shrinking_thread_pool_t( std::size_t num_workers, std::size_t shrink_depth ) : shrink_depth_( shrink_depth ) {
+        if ( !num_workers ) {
+            num_workers = std::max( 1u, std::thread::hardware_concurrency() );
+        }
+        for ( std::size_t i = 0; i < num_workers; ++i ) {
+            workers_.emplace_back( [this] { work(); } );
+        }
+    }
+
+    ~shrinking_thread_pool_t() {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for ( auto & worker : workers_ ) {
+            worker.join();
+        }
+    }
+
+    shrinking_thread_pool_t( const shrinking_thread_pool_t & ) = delete;
+    shrinking_thread_pool_t & operator=( const shrinking_thread_pool_t & ) = delete;
+
+    void submit( std::function< void() > task ) {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            tasks_.push_back( std::move( task ) );
+        }
+        ready_.notify_one();
+    }
+
+    // Wait until every task submitted so far has run, then rethrow the first exception one of them threw.
+    void wait() {
+        std::unique_lock< std::mutex > lock( mutex_ );
+        idle_.wait( lock, [this] { return tasks_.empty() && !running_; } );
+        if ( except_ ) {
+            std::rethrow_exception( std::exchange( except_, nullptr ) );
+        }
+    }
+
+    thread_pool_stats stats() const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return stats_;
+    }
+
+    std::size_t shrink_depth() const { return shrink_depth_; }
+
+private:
+    void work() {
+        std::unique_lock< std::mutex > lock( mutex_ );
+        for ( ;; ) {
+            ready_.wait( lock, [this] { return stop_ || !tasks_.empty(); } );
+            if ( tasks_.empty() ) {
+                return;
+            }
+            std::function< void() > task = std::move( tasks_.front() );
+            tasks_.pop_front();
+            ++running_;
+            lock.unlock();
+
+            std::exception_ptr except;
+            try {
+                task();
+            } catch ( ... ) {
+                except = std::current_exception();
+            }
+            task = nullptr;
+
+            // the task's frames are gone, everything below this one is dead
+            const std::size_t depth = ThreadStackDepth();
+            const std::size_t released = depth > shrink_depth_ ? ThreadStackShrink() : 0;
+
+            lock.lock();
+            ++stats_.tasks;
+            stats_.shrinks += depth > shrink_depth_;
+            stats_.released_bytes += released;
+            stats_.max_depth = std::max( stats_.max_depth, depth );
+            if ( except && !except_ ) {
+                except_ = except;
+            }
+            if ( !--running_ && tasks_.empty() ) {
+                idle_.notify_all();
+            }
+        }
+    }
+
+    const std::size_t                       shrink_depth_;
+    std::vector< std::thread >              workers_;
+
+    mutable std::mutex                      mutex_;
+    std::condition_variable                 ready_;
+    std::condition_variable                 idle_;
+    std::deque< std::function< void() > >   tasks_;
+    std::size_t                             running_ = 0;
+    bool                                    stop_ = false;
+    std::exception_ptr                      except_;
+    thread_pool_stats                       stats_;
+};
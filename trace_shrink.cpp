@@ -0,0 +1,86 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "stack_trace.hpp"
+#ifndef _WIN32
+#include "segv_stack.hpp"
+#endif
+
+using think_co = boost::coroutines2::coroutine< void >;
+
+// Every resume consumes a depth that changes from round to round and shrinks again, every event traced from
+// the coroutine's own stack. Returns the seconds per resume.
+template< typename StackAllocator >
+double RunThinks( StackAllocator stack, int count, int rounds ) {
+    std::vector<think_co::push_type> thinks;
+    thinks.reserve( count );
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [i]( think_co::pull_type& c ) {
+            for ( unsigned round = 0;; ++round ) {
+                StackTraceHere( trace_event::resume );
+                StackConsume( (DWORD)(((i + round) % 8 + 1) * 100 * 1024) );
+                StackShrink();
+                StackTraceHere( trace_event::suspend );
+                c();
+            }
+        } );
+    }
+    timer time;
+    time.start();
+    for ( int n = 0; n < rounds; ++n ) {
+        for ( auto & think : thinks ) {
+            think();
+        }
+    }
+    return time.stop() / ((double)count * rounds);
+}
+
+int Convert( const char * in_path, const char * out_path ) {
+    std::ifstream in( in_path, std::ios::binary );
+    std::ofstream out( out_path );
+    if ( !StackTraceToChrome( in, out ) ) {
+        std::cerr << in_path << " is not a stack trace dump" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// TraceShrink [count] [trace.bin]        runs the thinks untraced and traced, dumps and converts the trace
+// TraceShrink --convert trace.bin trace.json
+int main( int argc, char ** argv ) {
+    if ( argc > 3 && 0 == std::strcmp( argv[1], "--convert" ) ) {
+        return Convert( argv[2], argv[3] );
+    }
+    int count = argc > 1 ? std::atoi( argv[1] ) : 1000;
+    std::string path = argc > 2 ? argv[2] : "trace.bin";
+    const int rounds = 4;
+    size_t stack_size = 1 * 1024 * 1024;
+
+    double untraced = RunThinks( reserved_fixedsize_stack{ stack_size }, count, rounds );
+    StackTraceStart();
+    double traced = RunThinks( reserved_fixedsize_stack{ stack_size }, count, rounds );
+#ifndef _WIN32
+    // the stacks grow through the fault handler here, which traces the guard hits
+    segv_stack_space_t space{ stack_size };
+    RunThinks( segv_fixedsize_stack{ space }, count, rounds );
+#endif
+    StackTraceStop();
+    std::cout << std::fixed << std::setprecision( 2 ) << "untraced: " << untraced * 1e6 << "us per resume\n"
+              << "traced:   " << traced * 1e6 << "us per resume" << std::endl;
+
+    {
+        std::ofstream out( path, std::ios::binary );
+        StackTraceDump( out );
+    }
+    std::ifstream in( path, std::ios::binary | std::ios::ate );
+    std::cout << "dumped " << in.tellg() / 1024 << "KiB to " << path << std::endl;
+    return Convert( path.c_str(), (path.substr( 0, path.rfind( '.' ) ) + ".json").c_str() );
+}
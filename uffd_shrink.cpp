@@ -0,0 +1,67 @@
+#include <boost/coroutine2/all.hpp>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "reserved_stack.hpp"
+#include "bench.hpp"
+#include "uffd_stack.hpp"
+
+int main( int argc, char ** argv ) {
+    using think_co = boost::coroutines2::coroutine< void >;
+    using stack_t = uffd_fixedsize_stack;
+    // every stack is a reservation of its own, the guard page and the range registered with userfaultfd are
+    // two mappings, so counts above about 32000 run out of vm.max_map_count
+    int count = argc > 1 ? std::atoi( argv[1] ) : 20'000;
+    int resumes = argc > 2 ? std::atoi( argv[2] ) : 2;
+    size_t batch_pages = argc > 3 ? std::atoi( argv[3] ) : 16;
+    size_t stack_size = 1 * 1024 * 1024;
+    std::vector<think_co::push_type> thinks;
+
+    uffd_stack_space_t space{ stack_size, batch_pages };
+    stack_t stack{ space };
+    thinks.reserve( count );
+
+    for ( int i = 0; i < count; ++i ) {
+        thinks.emplace_back( stack,
+        [&]( think_co::pull_type& c ) {
+            for ( ;; ) {
+                StackConsume( 900 * 1024 );
+                StackShrink();
+                c();
+            }
+        } );
+    }
+
+    timer time;
+    time.start();
+    for ( int n = 0; n < resumes; ++n ) {
+        for ( auto & think : thinks ) {
+            think();
+        }
+    }
+    double elapsed = time.stop();
+    std::cout << "Thought for " << elapsed << " seconds." << std::endl;
+
+    auto stats = space.stats();
+    std::cout << "faults: " << stats.faults << " (" << (double)stats.faults / ((double)count * resumes) << " per think)"
+              << ", copied pages: " << stats.copied
+              << ", zero pages: " << stats.zeropages
+              << ", batch retries: " << stats.retries << std::endl;
+
+    std::size_t max_depth = 0;
+    double total_depth = 0;
+    space.for_each_stack( [&]( const stack_header & hdr ) {
+        PBYTE deepest = hdr.deepest.load( std::memory_order_relaxed );
+        std::size_t depth = deepest ? hdr.top() - deepest : 0;
+        max_depth = std::max( max_depth, depth );
+        total_depth += depth;
+    } );
+    std::cout << "high-water: " << std::fixed << std::setprecision( 1 )
+              << total_depth / count / 1024 << "KiB mean, " << (double)max_depth / 1024 << "KiB max" << std::endl;
+
+    // the stacks have to go before the space that serves them
+    thinks.clear();
+    return 0;
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <boost/config.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <set>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "reserved_stack.hpp"
+
+struct uffd_stack_stats {
+    std::uint64_t faults = 0;       // missing page faults delivered to the handler
+    std::uint64_t copied = 0;       // pages filled from the zero page pool with UFFDIO_COPY
+    std::uint64_t zeropages = 0;    // read faults answered with UFFDIO_ZEROPAGE
+    std::uint64_t retries = 0;      // batches that ran into an already present page and fell back to one page
+};
+
+// Stacks whose missing pages are served by a userfaultfd handler thread instead of the kernel's own anonymous
+// fault path. Every fault is charged to the stack it happened on (stack_header::faults and ::deepest), and a
+// write fault fills up to batch_pages pages below the faulting one in one UFFDIO_COPY, so a deep call
+// chain takes a fault per batch instead of per page. Pages released by StackShrink fault back in through
+// the handler as well. With batching the recorded high-water mark is exact to within batch_pages, the pages
+// filled below the faulting one are not known to be touched. Needs userfaultfd access, i.e. CAP_SYS_PTRACE
+// or vm.unprivileged_userfaultfd=1.
+class uffd_stack_space_t {
+public:
+    uffd_stack_space_t( std::size_t stack_size, std::size_t batch_pages = 16 ) :
+        batch_pages_( batch_pages ? batch_pages : 1 ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        const std::size_t pages( static_cast< std::size_t >( std::floor( static_cast< float >(stack_size) / page_size )) );
+        BOOST_ASSERT_MSG( 3 <= pages, "the guard and the initial commit must fit into stack" );
+        size_ = pages * page_size;
+        align_ = stack_alignment( size_ );
+
+        uffd_ = (int)::syscall( SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK );
+        if ( uffd_ < 0 ) {
+            throw std::system_error( errno, std::system_category(), "userfaultfd" );
+        }
+        uffdio_api api = {};
+        api.api = UFFD_API;
+        if ( 0 != ::ioctl( uffd_, UFFDIO_API, &api ) ) {
+            const int err = errno;
+            ::close( uffd_ );
+            throw std::system_error( err, std::system_category(), "UFFDIO_API" );
+        }
+
+        // source pages for UFFDIO_COPY, zeroed once and never written again
+        zero_pool_ = ::mmap( nullptr, batch_pages_ * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+        if ( zero_pool_ == MAP_FAILED ) {
+            ::close( uffd_ );
+            throw std::bad_alloc();
+        }
+        wake_fd_ = ::eventfd( 0, EFD_CLOEXEC );
+        if ( wake_fd_ < 0 ) {
+            const int err = errno;
+            ::munmap( zero_pool_, batch_pages_ * page_size );
+            ::close( uffd_ );
+            throw std::system_error( err, std::system_category(), "eventfd" );
+        }
+
+        handler_ = std::thread( [this] { serve(); } );
+    }
+
+    ~uffd_stack_space_t() {
+        const std::uint64_t one = 1;
+        BOOST_VERIFY( sizeof( one ) == ::write( wake_fd_, &one, sizeof( one ) ) );
+        handler_.join();
+        ::close( wake_fd_ );
+        ::close( uffd_ );
+        ::munmap( zero_pool_, batch_pages_ * boost::context::stack_traits::page_size() );
+    }
+
+    uffd_stack_space_t( const uffd_stack_space_t & ) = delete;
+    uffd_stack_space_t & operator=( const uffd_stack_space_t & ) = delete;
+
+    boost::context::stack_context allocate() {
+        const auto one_page_size = boost::context::stack_traits::page_size();
+
+        PBYTE vp = ReserveAlignedTop( size_, align_ );
+        if ( !vp ) throw std::bad_alloc();
+
+        if ( 0 != ::mprotect( vp + one_page_size, size_ - one_page_size, PROT_READ | PROT_WRITE ) ) {
+            ::munmap( vp, size_ );
+            throw std::bad_alloc();
+        }
+
+        // the header page and the one below it are committed before registering, the handler reads the
+        // header to charge faults and must never fault on it itself
+        const auto init_commit_size = one_page_size + one_page_size;
+        CommitPages( vp + size_ - init_commit_size, init_commit_size );
+        stack_header * hdr = InitStackHeader( vp, size_, one_page_size );
+
+        uffdio_register reg = {};
+        reg.range.start = (std::uintptr_t)hdr->usable();
+        reg.range.len = size_ - one_page_size;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if ( 0 != ::ioctl( uffd_, UFFDIO_REGISTER, &reg ) ) {
+            ::munmap( vp, size_ );
+            throw std::bad_alloc();
+        }
+
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stacks_.insert( hdr );
+        }
+
+        boost::context::stack_context sctx;
+        sctx.sp = reinterpret_cast< char * >(hdr);
+        sctx.size = static_cast< char * >(sctx.sp) - reinterpret_cast< char * >(vp);
+        return sctx;
+    }
+
+    void deallocate( boost::context::stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        auto hdr = reinterpret_cast< stack_header * >(sctx.sp);
+        BOOST_ASSERT( hdr->self == hdr );
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stacks_.erase( hdr );
+        }
+        // unmapping drops the registration with it
+        ::munmap( hdr->base, hdr->size );
+    }
+
+    // Call fn( const stack_header & ) for every live stack, e.g. to collect per coroutine high-water marks.
+    // Stacks must not be allocated or released from inside fn.
+    template< typename Fn >
+    void for_each_stack( Fn && fn ) const {
+        std::lock_guard< std::mutex > lock( mutex_ );
+        for ( const stack_header * hdr : stacks_ ) {
+            fn( *hdr );
+        }
+    }
+
+    uffd_stack_stats stats() const {
+        uffd_stack_stats s;
+        s.faults = faults_.load( std::memory_order_relaxed );
+        s.copied = copied_.load( std::memory_order_relaxed );
+        s.zeropages = zeropages_.load( std::memory_order_relaxed );
+        s.retries = retries_.load( std::memory_order_relaxed );
+        return s;
+    }
+
+    std::size_t get_stack_size() const { return size_; }
+
+private:
+    void serve() {
+        pollfd fds[2] = { { uffd_, POLLIN, 0 }, { wake_fd_, POLLIN, 0 } };
+        uffd_msg msgs[16];
+        for ( ;; ) {
+            if ( ::poll( fds, 2, -1 ) < 0 ) {
+                BOOST_ASSERT( errno == EINTR );
+                continue;
+            }
+            if ( fds[1].revents & POLLIN ) {
+                return;
+            }
+            const ssize_t bytes = ::read( uffd_, msgs, sizeof( msgs ) );
+            if ( bytes <= 0 ) {
+                continue;
+            }
+            for ( ssize_t i = 0; i < bytes / (ssize_t)sizeof( uffd_msg ); ++i ) {
+                if ( msgs[i].event == UFFD_EVENT_PAGEFAULT ) {
+                    resolve( msgs[i].arg.pagefault.address, msgs[i].arg.pagefault.flags );
+                }
+            }
+        }
+    }
+
+    void resolve( std::uint64_t address, std::uint64_t flags ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        PBYTE pPage = (PBYTE)(address & ~(std::uint64_t)(page_size - 1));
+        faults_.fetch_add( 1, std::memory_order_relaxed );
+
+        // the faulting thread is blocked on this stack, so it cannot go away underneath us
+        stack_header * hdr = find_stack_header( pPage, align_ );
+        BOOST_ASSERT_MSG( hdr, "fault outside of a uffd stack" );
+        hdr->faults.fetch_add( 1, std::memory_order_relaxed );
+        PBYTE deepest = hdr->deepest.load( std::memory_order_relaxed );
+        if ( !deepest || pPage < deepest ) {
+            hdr->deepest.store( pPage, std::memory_order_relaxed );
+        }
+
+        if ( !(flags & UFFD_PAGEFAULT_FLAG_WRITE) ) {
+            uffdio_zeropage zero = {};
+            zero.range.start = (std::uintptr_t)pPage;
+            zero.range.len = page_size;
+            if ( 0 == ::ioctl( uffd_, UFFDIO_ZEROPAGE, &zero ) ) {
+                zeropages_.fetch_add( 1, std::memory_order_relaxed );
+            } else {
+                wake( pPage );
+            }
+            return;
+        }
+
+        // stacks grow down, fill the pages below the faulting one as well
+        std::size_t pages = std::min< std::size_t >( batch_pages_, (pPage - hdr->usable()) / page_size + 1 );
+        PBYTE pBegin = pPage - (pages - 1) * page_size;
+        if ( copy( pBegin, pages ) ) {
+            StackTrace( trace_event::guard_hit, hdr->base, pages );
+            return;
+        }
+        if ( pages > 1 ) {
+            retries_.fetch_add( 1, std::memory_order_relaxed );
+            if ( copy( pPage, 1 ) ) {
+                return;
+            }
+        }
+        // somebody else filled it in the meantime
+        wake( pPage );
+    }
+
+    bool copy( PBYTE pBegin, std::size_t pages ) {
+        const auto page_size = boost::context::stack_traits::page_size();
+        uffdio_copy cp = {};
+        cp.dst = (std::uintptr_t)pBegin;
+        cp.src = (std::uintptr_t)zero_pool_;
+        cp.len = pages * page_size;
+        if ( 0 == ::ioctl( uffd_, UFFDIO_COPY, &cp ) ) {
+            copied_.fetch_add( pages, std::memory_order_relaxed );
+            return true;
+        }
+        if ( cp.copy > 0 ) {
+            copied_.fetch_add( cp.copy / page_size, std::memory_order_relaxed );
+        }
+        return false;
+    }
+
+    void wake( PBYTE pPage ) {
+        uffdio_range range = {};
+        range.start = (std::uintptr_t)pPage;
+        range.len = boost::context::stack_traits::page_size();
+        ::ioctl( uffd_, UFFDIO_WAKE, &range );
+    }
+
+    std::size_t                     size_;
+    std::size_t                     align_;
+    std::size_t                     batch_pages_;
+    int                             uffd_ = -1;
+    int                             wake_fd_ = -1;
+    void *                          zero_pool_ = nullptr;
+    std::thread                     handler_;
+
+    mutable std::mutex              mutex_;
+    std::set< stack_header * >      stacks_;
+
+    std::atomic< std::uint64_t >    faults_{ 0 };
+    std::atomic< std::uint64_t >    copied_{ 0 };
+    std::atomic< std::uint64_t >    zeropages_{ 0 };
+    std::atomic< std::uint64_t >    retries_{ 0 };
+};
+
+// StackAllocator handle onto a uffd_stack_space_t.
+class uffd_fixedsize_stack {
+private:
+    uffd_stack_space_t * space_;
+
+public:
+    typedef boost::context::stack_traits traits_type;
+    typedef boost::context::stack_context stack_context;
+
+    uffd_fixedsize_stack( uffd_stack_space_t & space ) BOOST_NOEXCEPT_OR_NOTHROW :
+        space_( &space ) {
+    }
+
+    stack_context allocate() {
+        return space_->allocate();
+    }
+
+    void deallocate( stack_context & sctx ) BOOST_NOEXCEPT_OR_NOTHROW {
+        BOOST_ASSERT( sctx.sp );
+        space_->deallocate( sctx );
+    }
+};